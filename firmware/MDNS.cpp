@@ -1,14 +1,70 @@
 #include "MDNS.h"
 
+#if HAL_PLATFORM_IFAPI
+#include "ifapi.h"
+#endif
+
+// Timings are taken in system ticks and leave out the time spent sending
+// datagrams in between, which is sampled on its own.
+#if MDNS_STATS
+#define STATS_COUNT(field, n) (counters.field += (n))
+#define STATS_START(start) uint32_t start = System.ticks() - sendTicks
+#define STATS_SAMPLE(histogram, start) addSample(counters.histogram, System.ticks() - sendTicks - (start))
+#define STATS_SEND(start) (sendTicks += addSample(counters.sendMicros, System.ticks() - sendTicks - (start)))
+#else
+#define STATS_COUNT(field, n)
+#define STATS_START(start)
+#define STATS_SAMPLE(histogram, start)
+#define STATS_SEND(start)
+#endif
+
+static constexpr auto SUB_LABEL = wireLabel("_sub");
+static constexpr auto SERVICES_LABEL = wireLabel("_services");
+static constexpr auto DNS_SD_LABEL = wireLabel("_dns-sd");
+static constexpr auto UDP_LABEL = wireLabel("_udp");
+
 Buffer::Buffer(uint16_t size) {
   this->data = (uint8_t *) malloc(size);
   this->size = data != NULL? size : 0;
 }
 
+Buffer::~Buffer() {
+  free(data);
+}
+
+bool Buffer::setSize(uint16_t size) {
+  uint8_t * data = (uint8_t *) realloc(this->data, size);
+
+  if (data != NULL) {
+    this->data = data;
+    this->size = size;
+    clear();
+  }
+
+  return data != NULL;
+}
+
+uint16_t Buffer::getSize() {
+  return size;
+}
+
 uint16_t Buffer::available() {
   return offset < limit? limit - offset : offset - limit;
 }
 
+bool Buffer::overflow() {
+  return overflowed;
+}
+
+void Buffer::rewind(uint16_t offset) {
+  this->offset = offset;
+  this->overflowed = false;
+
+  while (!names.empty() && names.back().offset >= offset) {
+    names.pop_back();
+  }
+}
+
 void Buffer::mark() {
   if (markOffset == INVALID_MARK_OFFSET) {
     markOffset = offset;
@@ -36,16 +92,22 @@ void Buffer::read(UDP * udp) {
 }
 
 uint8_t Buffer::readUInt8() {
-  return data[offset++];
+  return offset < limit? data[offset++] : 0;
 }
 
 uint16_t Buffer::readUInt16() {
   return readUInt8() << 8 | readUInt8();
 }
 
+uint32_t Buffer::readUInt32() {
+  return (uint32_t) readUInt16() << 16 | readUInt16();
+}
+
 void Buffer::writeUInt8(uint8_t value) {
   if (offset < size) {
     data[offset++] = value;
+  } else {
+    overflowed = true;
   }
 }
 
@@ -61,127 +123,418 @@ void Buffer::writeUInt32(uint32_t value) {
   writeUInt8(value);
 }
 
+void Buffer::writeBytes(const uint8_t * data, uint16_t length) {
+  if (length > size - offset) {
+    length = size - offset;
+    overflowed = true;
+  }
+
+  if (length > 0) {
+    memcpy(this->data + offset, data, length);
+    offset += length;
+  }
+}
+
 void Buffer::write(UDP * udp) {
   udp->write(data, offset);
 
   offset = 0;
+  overflowed = false;
+}
+
+void Buffer::copy(std::vector<uint8_t> & data) {
+  data.insert(data.end(), this->data, this->data + offset);
+}
+
+// Each name written is followed through the buffer, pointers included, so
+// any of its suffixes can be pointed to. Any earlier copy of the same name
+// will do, whichever labels it was written from.
+int16_t Buffer::findName(Label * label) {
+  for (std::vector<Name>::const_iterator i = names.begin(); i != names.end(); ++i) {
+    Label * name = i->label;
+    uint16_t offset = i->offset;
+
+    while (name != NULL && name->getSize() > 0 && offset + 1 < this->offset) {
+      if (name->equals(label)) {
+        return offset;
+      }
+
+      if ((data[offset] & LABEL_POINTER) == LABEL_POINTER) {
+        offset = (data[offset] & ~LABEL_POINTER) << 8 | data[offset + 1];
+      } else {
+        offset += data[offset] + 1;
+      }
+
+      name = name->getNextLabel();
+    }
+  }
+
+  return INVALID_OFFSET;
+}
+
+void Buffer::addName(Label * label, uint16_t offset) {
+  Name name = { label, offset };
+
+  names.push_back(name);
 }
 
 void Buffer::clear() {
   offset = 0;
   limit = 0;
+  overflowed = false;
+  names.clear();
+}
+
+Arena::Arena(uint16_t size) {
+  this->data = (uint8_t *) malloc(size);
+  this->size = data != NULL? size : 0;
+}
+
+// First fit over the blocks below top, merging runs of free blocks on the
+// way, then bump allocation from top. Once the arena is exhausted blocks come
+// from the heap, so configuration still succeeds; memoryUsage reports how
+// much spilled over. A block records its size in 16 bits, so anything larger
+// than ARENA_MAX_BLOCK_SIZE fails rather than wrapping.
+void * Arena::allocate(size_t size) {
+  size_t header = align(sizeof(Block));
+  uint16_t offset = 0;
+
+  if (size > ARENA_MAX_BLOCK_SIZE) {
+    return NULL;
+  }
+
+  size = align(size > 0 ? size : 1);
+
+  while (offset < top) {
+    Block * block = (Block *) (data + offset);
+
+    if (block->free) {
+      uint16_t next = offset + header + block->size;
+
+      while (next < top && ((Block *) (data + next))->free) {
+        block->size += header + ((Block *) (data + next))->size;
+        next = offset + header + block->size;
+      }
+
+      if (next >= top) {
+        top = offset;
+        break;
+      }
+
+      if (block->size >= size) {
+        if (block->size >= size + header + ARENA_ALIGNMENT) {
+          Block * rest = (Block *) (data + offset + header + size);
+
+          rest->size = block->size - size - header;
+          rest->free = true;
+          rest->heap = false;
+
+          block->size = size;
+        }
+
+        block->free = false;
+        used += header + block->size;
+
+        return data + offset + header;
+      }
+    }
+
+    offset += header + block->size;
+  }
+
+  if (top + header + size <= this->size) {
+    Block * block = (Block *) (data + top);
+
+    block->size = size;
+    block->free = false;
+    block->heap = false;
+
+    top += header + size;
+    used += header + size;
+
+    return (uint8_t *) block + header;
+  }
+
+  Block * block = (Block *) malloc(header + size);
+
+  if (block == NULL) {
+    return NULL;
+  }
+
+  block->size = size;
+  block->free = false;
+  block->heap = true;
+
+  heapUsed += header + size;
+
+  return (uint8_t *) block + header;
+}
+
+void Arena::release(void * p) {
+  if (p == NULL) {
+    return;
+  }
+
+  size_t header = align(sizeof(Block));
+  Block * block = (Block *) ((uint8_t *) p - header);
+
+  if (block->heap) {
+    heapUsed -= header + block->size;
+
+    free(block);
+  } else {
+    block->free = true;
+    used -= header + block->size;
+
+    if ((uint8_t *) p + block->size == data + top) {
+      top = (uint8_t *) block - data;
+    }
+  }
+}
+
+uint16_t Arena::getSize() {
+  return size;
+}
+
+uint16_t Arena::getUsed() {
+  return used;
+}
+
+uint32_t Arena::getHeapUsed() {
+  return heapUsed;
+}
+
+size_t Arena::align(size_t size) {
+  return (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+}
+
+void * operator new(size_t size, Arena * arena) noexcept {
+  return arena->allocate(size);
+}
+
+void operator delete(void * p, Arena * arena) {
+  arena->release(p);
 }
 
-Record::Record(uint16_t type, uint32_t ttl) {
+Record::Record(uint16_t type, uint32_t ttl, bool shared) {
   this->type = type;
   this->ttl = ttl;
+  this->shared = shared;
+}
+
+Record::~Record() {
 }
 
 void Record::setLabel(Label * label) {
   this->label = label;
+
+  if (table != NULL) {
+    table->setLabel(index, label);
+  }
 }
 
 void Record::setAnswerRecord() {
-  this->answerRecord = true;
+  if (table != NULL) {
+    table->set(ANSWER_RECORDS, index);
+  }
 }
 
-bool Record::isAnswerRecord() {
-  return answerRecord && !knownRecord;
+void Record::setAdditionalRecord() {
+  if (table != NULL) {
+    table->set(ADDITIONAL_RECORDS, index);
+  }
 }
 
-void Record::setAdditionalRecord() {
-  this->additionalRecord = true;
+void Record::setKnownRecord() {
+  if (table != NULL) {
+    table->set(KNOWN_RECORDS, index);
+  }
 }
 
-bool Record::isAdditionalRecord() {
-  return additionalRecord && !answerRecord && !knownRecord;
+void Record::setDuplicateRecord() {
+  if (table != NULL) {
+    table->set(DUPLICATE_RECORDS, index);
+  }
 }
 
-void Record::setKnownRecord() {
-  this->knownRecord = true;
+bool Record::isShared() {
+  return shared;
+}
+
+void Record::setMulticast(unsigned long time) {
+  this->multicast = true;
+  this->multicastTime = time;
+}
+
+bool Record::isRateLimited(unsigned long time) {
+  return multicast && time - multicastTime < MULTICAST_INTERVAL;
+}
+
+bool Record::matches(Label * label, uint16_t type, Buffer * buffer, uint16_t length) {
+  return this->label == label && this->type == type && matchesSpecific(buffer, length);
+}
+
+uint32_t Record::getTTL() {
+  return ttl;
+}
+
+uint16_t Record::getType() {
+  return type;
 }
 
-void Record::write(Buffer * buffer) {
+void Record::write(Buffer * buffer, uint32_t maxTTL, bool cacheFlush) {
   label->write(buffer);
   buffer->writeUInt16(type);
-  buffer->writeUInt16(IN_CLASS);
-  buffer->writeUInt32(ttl);
+  buffer->writeUInt16(cacheFlush && !isShared() ? IN_CLASS | CACHE_FLUSH_FLAG : IN_CLASS);
+  buffer->writeUInt32(ttl < maxTTL ? ttl : maxTTL);
   writeSpecific(buffer);
 }
 
-void Record::reset() {
-  this->answerRecord = false;
-  this->additionalRecord = false;
-  this->knownRecord = false;
+void Record::writeData(Buffer * buffer) {
+  writeSpecific(buffer);
 }
 
 Label * Record::getLabel() {
   return label;
 }
 
-ARecord::ARecord():Record(A_TYPE, TTL_2MIN) {
+bool Record::matchesSpecific(Buffer * buffer, uint16_t length) {
+  return false;
 }
 
-void ARecord::writeSpecific(Buffer * buffer) {
-  buffer->writeUInt16(4);
-  IPAddress ip = WiFi.localIP();
-  for (int i = 0; i < IP_SIZE; i++) {
-    buffer->writeUInt8(ip[i]);
+AddressRecord::AddressRecord(uint16_t type, uint8_t size):Record(type, TTL_2MIN) {
+  this->size = size;
+
+  memset(address, 0, sizeof(address));
+}
+
+void AddressRecord::setAddress(const uint8_t * address) {
+  memcpy(this->address, address, size);
+}
+
+bool AddressRecord::hasAddress(uint16_t type, const uint8_t * address) {
+  return getType() == type && memcmp(this->address, address, size) == 0;
+}
+
+void AddressRecord::writeSpecific(Buffer * buffer) {
+  buffer->writeUInt16(size);
+  buffer->writeBytes(address, size);
+}
+
+bool AddressRecord::matchesSpecific(Buffer * buffer, uint16_t length) {
+  bool result = length == size;
+
+  for (uint8_t i = 0; result && i < size; i++) {
+    result = buffer->readUInt8() == address[i];
   }
+
+  return result;
+}
+
+ARecord::ARecord():AddressRecord(A_TYPE, IP_SIZE) {
+}
+
+AAAARecord::AAAARecord():AddressRecord(AAAA_TYPE, IPV6_SIZE) {
 }
 
 NSECRecord::NSECRecord():Record(NSEC_TYPE, TTL_2MIN) {
 }
 
-HostNSECRecord::HostNSECRecord():NSECRecord() {
+void NSECRecord::addType(uint16_t type) {
+  if (type < NSEC_BITMAP_SIZE * 8) {
+    bitmap[type / 8] |= 0x80 >> (type % 8);
+  }
 }
 
-void HostNSECRecord::writeSpecific(Buffer * buffer) {
-  buffer->writeUInt16(5);
-  getLabel()->write(buffer);
-  buffer->writeUInt8(0);
-  buffer->writeUInt8(1);
-  buffer->writeUInt8(0x40);
+void NSECRecord::clearTypes() {
+  memset(bitmap, 0, sizeof(bitmap));
 }
 
-InstanceNSECRecord::InstanceNSECRecord():NSECRecord() {
+uint8_t NSECRecord::getBitmapSize() {
+  uint8_t length = NSEC_BITMAP_SIZE;
+
+  while (length > 0 && bitmap[length - 1] == 0) {
+    length--;
+  }
+
+  return length;
 }
 
-void InstanceNSECRecord::writeSpecific(Buffer * buffer) {
-  buffer->writeUInt16(9);
+// One window block for types below 256, trimmed after the last type present.
+void NSECRecord::writeSpecific(Buffer * buffer) {
+  uint8_t length = getBitmapSize();
+
+  buffer->writeUInt16(getLabel()->getWriteSize(buffer) + (length > 0 ? 2 + length : 0));
   getLabel()->write(buffer);
-  buffer->writeUInt8(0);
-  buffer->writeUInt8(5);
-  buffer->writeUInt8(0);
-  buffer->writeUInt8(0);
-  buffer->writeUInt8(0x80);
-  buffer->writeUInt8(0);
-  buffer->writeUInt8(0x40);
+
+  if (length > 0) {
+    buffer->writeUInt8(0);
+    buffer->writeUInt8(length);
+    buffer->writeBytes(bitmap, length);
+  }
+}
+
+// Our own NSEC, repeated by a peer or looped back, is not a conflict.
+bool NSECRecord::matchesSpecific(Buffer * buffer, uint16_t length) {
+  uint16_t start = buffer->getOffset();
+  uint8_t size = getBitmapSize();
+
+  if (!getLabel()->matches(buffer)) {
+    return false;
+  }
+
+  uint16_t remaining = length - (buffer->getOffset() - start);
+
+  if (size == 0) {
+    return remaining == 0;
+  }
+
+  bool result = remaining == 2 + size && buffer->readUInt8() == 0 && buffer->readUInt8() == size;
+
+  for (uint8_t i = 0; result && i < size; i++) {
+    result = buffer->readUInt8() == bitmap[i];
+  }
+
+  return result;
 }
 
-PTRRecord::PTRRecord():Record(PTR_TYPE, TTL_75MIN) {
+// Reverse address mappings are the only unique PTR records; like other
+// records naming the host they live for two minutes.
+PTRRecord::PTRRecord(bool shared):Record(PTR_TYPE, shared ? TTL_75MIN : TTL_2MIN, shared) {
 }
 
 void PTRRecord::writeSpecific(Buffer * buffer) {
-  buffer->writeUInt16(instanceLabel->getWriteSize());
+  buffer->writeUInt16(instanceLabel->getWriteSize(buffer));
   instanceLabel->write(buffer);
 }
 
+bool PTRRecord::matchesSpecific(Buffer * buffer, uint16_t length) {
+  return instanceLabel->matches(buffer);
+}
+
 void PTRRecord::setInstanceLabel(Label * label) {
   instanceLabel = label;
 }
 
+Label * PTRRecord::getInstanceLabel() {
+  return instanceLabel;
+}
+
 SRVRecord::SRVRecord():Record(SRV_TYPE, TTL_2MIN) {
 }
 
 void SRVRecord::writeSpecific(Buffer * buffer) {
-  buffer->writeUInt16(6 + hostLabel->getWriteSize());
+  buffer->writeUInt16(6 + hostLabel->getWriteSize(buffer));
   buffer->writeUInt16(0);
   buffer->writeUInt16(0);
   buffer->writeUInt16(port);
   hostLabel->write(buffer);
 }
 
+bool SRVRecord::matchesSpecific(Buffer * buffer, uint16_t length) {
+  return length > 6 && buffer->readUInt16() == 0 && buffer->readUInt16() == 0 && buffer->readUInt16() == port && hostLabel->matches(buffer);
+}
+
 void SRVRecord::setHostLabel(Label * label) {
   hostLabel = label;
 }
@@ -190,7 +543,12 @@ void SRVRecord::setPort(uint16_t port) {
   this->port = port;
 }
 
-TXTRecord::TXTRecord():Record(TXT_TYPE, TTL_75MIN) {
+TXTRecord::TXTRecord(Arena * arena):Record(TXT_TYPE, TTL_75MIN) {
+  this->arena = arena;
+}
+
+TXTRecord::~TXTRecord() {
+  release();
 }
 
 void TXTRecord::addEntry(String key, String value) {
@@ -201,532 +559,3520 @@ void TXTRecord::addEntry(String key, String value) {
     entry += value;
   }
 
-  data.push_back(entry);
+  append(entry);
 }
 
-void TXTRecord::writeSpecific(Buffer * buffer) {
+void TXTRecord::setEntries(std::vector<String> entries) {
   uint16_t size = 0;
 
-  std::vector<String>::const_iterator i;
-
-  for(i = data.begin(); i != data.end(); ++i) {
-    size += i->length() + 1;
+  for (std::vector<String>::const_iterator i = entries.begin(); i != entries.end(); ++i) {
+    size += (i->length() < MAX_TXT_ENTRY_SIZE ? i->length() : MAX_TXT_ENTRY_SIZE) + 1;
   }
 
-  buffer->writeUInt16(size);
+  uint8_t * data = size > 0 ? (uint8_t *) arena->allocate(size) : NULL;
 
-  for(i = data.begin(); i != data.end(); ++i) {
-    uint8_t length = i->length();
+  release();
 
-    buffer->writeUInt8(length);
+  this->data = data;
+  this->size = 0;
+  this->owned = true;
 
-    for (uint8_t idx = 0; idx < length; idx++) {
-      buffer->writeUInt8(i->charAt(idx));
-    }
+  for (std::vector<String>::const_iterator i = entries.begin(); data != NULL && i != entries.end(); ++i) {
+    this->size += encode(data + this->size, *i);
   }
 }
 
-Label::Label(String name, Label * nextLabel, bool caseSensitive) {
-  data = (uint8_t *) malloc(name.length() + 1);
+// Entries are kept in wire format, each prefixed by its length, so a
+// response copies the whole RDATA in one go.
+void TXTRecord::append(String entry) {
+  uint8_t * data = (uint8_t *) arena->allocate(size + entry.length() + 1);
 
-  if (data) {
-    data[0] = name.length();
-    for (uint8_t i = 0; i < name.length(); i++) {
-      data[i + 1] = name.charAt(i);
+  if (data != NULL) {
+    if (size > 0) {
+      memcpy(data, this->data, size);
     }
-  } else {
-    data = EMPTY_DATA;
-  }
 
-  this->nextLabel = nextLabel;
-  this->caseSensitive = caseSensitive;
-}
+    release();
 
-uint8_t Label::getSize() {
-  return data[0];
+    this->data = data;
+    this->size += encode(data + size, entry);
+    this->owned = true;
+  }
 }
 
-uint8_t Label::getWriteSize() {
-  Label * label = this;
-  uint8_t size = 0;
-
-  while (label != NULL) {
-    if (label->writeOffset == INVALID_OFFSET) {
-      size += label->data[0] + 1;
-      label = label->nextLabel;
-    } else {
-      size += 2;
-      label = NULL;
-    }
-  }
+// Borrowed data, typically const data in flash, is used as is and never
+// released.
+void TXTRecord::setData(const uint8_t * data, uint16_t size) {
+  release();
 
-  return size;
+  this->data = data;
+  this->size = size;
+  this->owned = false;
 }
 
-void Label::write(Buffer * buffer) {
-  Label * label = this;
-
-  while (label) {
-    if (label->writeOffset == INVALID_OFFSET) {
-      label->writeOffset = buffer->getOffset();
+void TXTRecord::release() {
+  if (owned) {
+    arena->release((void *) data);
+  }
+}
 
-      uint8_t size = label->data[0] + 1;
+uint16_t TXTRecord::encode(uint8_t * data, String entry) {
+  uint8_t length = entry.length() < MAX_TXT_ENTRY_SIZE ? entry.length() : MAX_TXT_ENTRY_SIZE;
 
-      for (uint8_t i = 0; i < size; i++) {
-        buffer->writeUInt8(label->data[i]);
-      }
+  data[0] = length;
+  memcpy(data + 1, entry.c_str(), length);
 
-      label = label->nextLabel;
-    } else {
-      buffer->writeUInt16((LABEL_POINTER << 8) | label->writeOffset);
-      label = NULL;
-    }
-  }
+  return length + 1;
 }
 
-void Label::reset() {
-  Label * label = this;
+void TXTRecord::writeSpecific(Buffer * buffer) {
+  buffer->writeUInt16(size);
+  buffer->writeBytes(data, size);
+}
 
-  while (label != NULL) {
-    label->writeOffset = INVALID_OFFSET;
+bool TXTRecord::matchesSpecific(Buffer * buffer, uint16_t length) {
+  bool result = length == size;
 
-    label = label->nextLabel;
+  for (uint16_t i = 0; result && i < size; i++) {
+    result = buffer->readUInt8() == data[i];
   }
+
+  return result;
 }
 
-Label::Reader::Reader(Buffer * buffer) {
-  this->buffer = buffer;
+RecordTable::const_iterator RecordTable::begin() const {
+  return records.begin();
 }
 
-bool Label::Reader::hasNext() {
-  return c != END_OF_NAME && buffer->available() > 0;
+RecordTable::const_iterator RecordTable::end() const {
+  return records.end();
 }
 
-uint8_t Label::Reader::next() {
-  c = buffer->readUInt8();
+size_t RecordTable::size() const {
+  return records.size();
+}
 
-  while ((c & LABEL_POINTER) == LABEL_POINTER) {
-    if (buffer->available() > 0) {
-      uint8_t c2 = buffer->readUInt8();
+Record * RecordTable::operator[](size_t index) const {
+  return records[index];
+}
 
-      uint16_t pointerOffset = ((c & ~LABEL_POINTER) << 8) | c2;
+void RecordTable::reserve(size_t size) {
+  records.reserve(size);
+  labels.reserve(size);
+  types.reserve(size);
 
-      buffer->mark();
+  for (uint8_t set = 0; set < RECORD_SETS; set++) {
+    sets[set].reserve((size + RECORD_SET_BITS - 1) / RECORD_SET_BITS);
+  }
+}
 
-      buffer->setOffset(pointerOffset);
+void RecordTable::push_back(Record * record) {
+  record->table = this;
+  record->index = records.size();
 
-      c = buffer->readUInt8();
-    }
+  records.push_back(record);
+  labels.push_back(record->label);
+  types.push_back(record->type);
+
+  for (uint8_t set = 0; set < RECORD_SETS; set++) {
+    sets[set].resize((records.size() + RECORD_SET_BITS - 1) / RECORD_SET_BITS);
   }
 
-  return c;
+  assign(SHARED_RECORDS, record->index, record->isShared());
 }
 
-bool Label::Reader::endOfName() {
-  return c == END_OF_NAME;
-}
+// Later records move down one place, and so do their bits, so a response
+// being scheduled keeps what it had.
+void RecordTable::erase(Record * record) {
+  size_t index = std::find(records.begin(), records.end(), record) - records.begin();
 
-Label::Iterator::Iterator(Label * label) {
-  this->label = label;
-  this->startLabel = label;
-  this->size = label->data[0];
-}
+  if (index >= records.size()) {
+    return;
+  }
 
-bool Label::Iterator::match(uint8_t c) {
-  if (matches) {
-    while (offset > size && label) {
-      label = label->nextLabel;
-      size = label->data[0];
-      offset = 0;
+  for (size_t n = index; n + 1 < records.size(); n++) {
+    for (uint8_t set = 0; set < RECORD_SETS; set++) {
+      assign(set, n, test(set, n + 1));
     }
+  }
+
+  for (uint8_t set = 0; set < RECORD_SETS; set++) {
+    assign(set, records.size() - 1, false);
+  }
 
-    matches = offset <= size && label && (label->data[offset] == c || (!label->caseSensitive && equalsIgnoreCase(c)));
+  records.erase(records.begin() + index);
+  labels.erase(labels.begin() + index);
+  types.erase(types.begin() + index);
 
-    offset++;
+  for (size_t n = index; n < records.size(); n++) {
+    records[n]->index = n;
   }
 
-  return matches;
-}
+  for (uint8_t set = 0; set < RECORD_SETS; set++) {
+    sets[set].resize((records.size() + RECORD_SET_BITS - 1) / RECORD_SET_BITS);
+  }
 
-bool Label::Iterator::matched() {
-  return matches;
+  record->table = NULL;
 }
 
-bool Label::Iterator::equalsIgnoreCase(uint8_t c) {
-  return (c >= 'a' && c <= 'z' && label->data[offset] == c - 32) || (c >= 'A' && c <= 'Z' && label->data[offset] == c + 32);
+int32_t RecordTable::find(Label * label, uint16_t type, int32_t index) const {
+  for (size_t n = index; n < records.size(); n++) {
+    if (labels[n] == label && types[n] == type) {
+      return n;
+    }
+  }
+
+  return -1;
 }
 
-Label * Label::Iterator::getStartLabel() {
-  return startLabel;
+void RecordTable::setLabel(uint16_t index, Label * label) {
+  labels[index] = label;
 }
 
-Label * Label::Matcher::match(std::map<String, Label *> labels, Buffer * buffer) {
+void RecordTable::set(uint8_t set, uint16_t index) {
+  assign(set, index, true);
+}
 
-  Iterator * iterators[labels.size()];
+// Answers and additional records the querier already knows are dropped, the
+// rest join whatever is already scheduled. Returns whether a shared record
+// is among the scheduled answers.
+bool RecordTable::schedule() {
+  bool shared = false;
 
-  std::map<String, Label *>::const_iterator i;
+  for (size_t word = 0; word < sets[0].size(); word++) {
+    sets[SCHEDULED_ANSWER_RECORDS][word] |= sets[ANSWER_RECORDS][word] & ~sets[KNOWN_RECORDS][word];
+    sets[SCHEDULED_ADDITIONAL_RECORDS][word] |= sets[ADDITIONAL_RECORDS][word] & ~sets[KNOWN_RECORDS][word];
 
-  uint8_t idx = 0;
+    sets[ANSWER_RECORDS][word] = 0;
+    sets[ADDITIONAL_RECORDS][word] = 0;
+    sets[KNOWN_RECORDS][word] = 0;
 
-  for (i = labels.begin(); i != labels.end(); ++i) {
-    iterators[idx++] = new Iterator(i->second);
+    shared = shared || (sets[SCHEDULED_ANSWER_RECORDS][word] & ~sets[DUPLICATE_RECORDS][word] & sets[SHARED_RECORDS][word]) != 0;
   }
 
-  Reader * reader = new Reader(buffer);
+  return shared;
+}
 
-  while (reader->hasNext()) {
-    uint8_t size = reader->next();
+int32_t RecordTable::nextAnswer(int32_t index, bool unicast) const {
+  return next(index, false, unicast);
+}
 
-    uint8_t idx = 0;
+int32_t RecordTable::nextAdditional(int32_t index, bool unicast) const {
+  return next(index, true, unicast);
+}
 
-    for (uint8_t i = 0; i < labels.size(); i++) {
-      iterators[i]->match(size);
+void RecordTable::reset() {
+  for (uint8_t set = 0; set < RECORD_SETS; set++) {
+    if (set != SHARED_RECORDS) {
+      std::fill(sets[set].begin(), sets[set].end(), 0);
     }
+  }
+}
 
-    while(idx < size && reader->hasNext()) {
-      uint8_t c = reader->next();
+void RecordTable::resetUnicast() {
+  std::fill(sets[ANSWER_RECORDS].begin(), sets[ANSWER_RECORDS].end(), 0);
+  std::fill(sets[ADDITIONAL_RECORDS].begin(), sets[ADDITIONAL_RECORDS].end(), 0);
+  std::fill(sets[KNOWN_RECORDS].begin(), sets[KNOWN_RECORDS].end(), 0);
+}
+
+bool RecordTable::test(uint8_t set, size_t index) const {
+  return (sets[set][index / RECORD_SET_BITS] >> (index % RECORD_SET_BITS)) & 1;
+}
+
+void RecordTable::assign(uint8_t set, size_t index, bool value) {
+  uint32_t bit = (uint32_t) 1 << (index % RECORD_SET_BITS);
+
+  if (value) {
+    sets[set][index / RECORD_SET_BITS] |= bit;
+  } else {
+    sets[set][index / RECORD_SET_BITS] &= ~bit;
+  }
+}
+
+// Unicast replies are written straight from what the packet matched, while
+// multicast responses are written from what has been scheduled, less the
+// records another responder has already sent. A record is only additional
+// when it is not also an answer.
+uint32_t RecordTable::select(size_t word, bool additional, bool unicast) const {
+  if (unicast && additional) {
+    return sets[ADDITIONAL_RECORDS][word] & ~sets[ANSWER_RECORDS][word] & ~sets[KNOWN_RECORDS][word];
+  } else if (unicast) {
+    return sets[ANSWER_RECORDS][word] & ~sets[KNOWN_RECORDS][word];
+  } else if (additional) {
+    return sets[SCHEDULED_ADDITIONAL_RECORDS][word] & ~sets[SCHEDULED_ANSWER_RECORDS][word] & ~sets[DUPLICATE_RECORDS][word];
+  } else {
+    return sets[SCHEDULED_ANSWER_RECORDS][word] & ~sets[DUPLICATE_RECORDS][word];
+  }
+}
+
+int32_t RecordTable::next(int32_t index, bool additional, bool unicast) const {
+  for (size_t word = index / RECORD_SET_BITS; word < sets[0].size(); word++) {
+    uint32_t bits = select(word, additional, unicast);
+
+    if (word == (size_t) index / RECORD_SET_BITS) {
+      bits &= ~(uint32_t) 0 << (index % RECORD_SET_BITS);
+    }
+
+    if (bits != 0) {
+      return word * RECORD_SET_BITS + __builtin_ctz(bits);
+    }
+  }
+
+  return -1;
+}
+
+static const uint8_t EMPTY_LABEL[] = { END_OF_NAME };
+
+Label::Label(Arena * arena, String name, Label * nextLabel, bool caseSensitive) {
+  this->arena = arena;
+  this->data = EMPTY_LABEL;
+  this->owned = false;
+  this->nextLabel = nextLabel;
+  this->caseSensitive = caseSensitive;
+
+  setData(name);
+}
+
+// Borrowed data, a label in wire format such as wireLabel makes, is used as
+// is and never released.
+Label::Label(Arena * arena, const uint8_t * data, Label * nextLabel, bool caseSensitive) {
+  this->arena = arena;
+  this->data = data;
+  this->owned = false;
+  this->nextLabel = nextLabel;
+  this->caseSensitive = caseSensitive;
+}
+
+Label::~Label() {
+  if (owned) {
+    arena->release((void *) data);
+  }
+}
+
+bool Label::equals(String name) {
+  Label * label = this;
+  unsigned int offset = 0;
+
+  while (label != NULL && label->data[0] > 0) {
+    if (offset > 0 && name.charAt(offset++) != DOT) {
+      return false;
+    }
+
+    for (uint8_t i = 1; i <= label->data[0]; i++) {
+      if (name.charAt(offset++) != label->data[i]) {
+        return false;
+      }
+    }
+
+    label = label->nextLabel;
+  }
+
+  return offset == name.length();
+}
+
+bool Label::equals(const uint8_t * data) {
+  return this->data[0] == data[0] && memcmp(this->data + 1, data + 1, data[0]) == 0;
+}
+
+String Label::getName() {
+  String name;
+
+  for (uint8_t i = 1; i <= data[0]; i++) {
+    name += (char) data[i];
+  }
+
+  return name;
+}
+
+// Names compare byte for byte, case included, so a pointer to the other name
+// reads back exactly as this one.
+bool Label::equals(Label * label) {
+  Label * name = this;
+
+  while (name != NULL && label != NULL && name != label) {
+    if (!name->equals(label->data)) {
+      return false;
+    }
+
+    name = name->nextLabel;
+    label = label->nextLabel;
+  }
+
+  return name == label;
+}
+
+Label * Label::getNextLabel() {
+  return nextLabel;
+}
+
+void Label::setName(String name) {
+  setData(name);
+}
+
+void Label::setData(String name) {
+  uint8_t * data = (uint8_t *) arena->allocate(name.length() + 1);
+
+  if (data) {
+    data[0] = name.length();
+    for (uint8_t i = 0; i < name.length(); i++) {
+      data[i + 1] = name.charAt(i);
+    }
+
+    if (owned) {
+      arena->release((void *) this->data);
+    }
+
+    this->data = data;
+    this->owned = true;
+  }
+}
+
+uint16_t Label::read(Buffer * buffer, uint8_t * name) {
+  Reader reader(buffer);
+
+  return reader.read(name);
+}
+
+uint8_t Label::getSize() {
+  return data[0];
+}
+
+uint8_t Label::getWriteSize(Buffer * buffer) {
+  Label * label = this;
+  uint8_t size = 0;
+
+  while (label != NULL) {
+    if (label->data[0] == END_OF_NAME || buffer->findName(label) == INVALID_OFFSET) {
+      size += label->data[0] + 1;
+      label = label->nextLabel;
+    } else {
+      size += 2;
+      label = NULL;
+    }
+  }
+
+  return size;
+}
+
+// The longest suffix already in the packet is replaced by a pointer. The root
+// label never is: it is no shorter, and it ends names outside .local too.
+void Label::write(Buffer * buffer) {
+  Label * label = this;
+
+  while (label) {
+    int16_t offset = label->data[0] == END_OF_NAME ? INVALID_OFFSET : buffer->findName(label);
+
+    if (offset == INVALID_OFFSET) {
+      if (label == this && label->data[0] != END_OF_NAME) {
+        buffer->addName(label, buffer->getOffset());
+      }
+
+      buffer->writeBytes(label->data, label->data[0] + 1);
+
+      label = label->nextLabel;
+    } else {
+      buffer->writeUInt16((LABEL_POINTER << 8) | offset);
+      label = NULL;
+    }
+  }
+}
+
+Label::Reader::Reader(Buffer * buffer) {
+  this->buffer = buffer;
+  this->start = buffer->getOffset();
+}
+
+bool Label::Reader::hasNext() {
+  return c != END_OF_NAME && buffer->available() > 0;
+}
+
+uint8_t Label::Reader::next() {
+  c = buffer->readUInt8();
+
+  while ((c & LABEL_POINTER) == LABEL_POINTER) {
+    uint16_t pointerOffset = ((c & ~LABEL_POINTER) << 8) | buffer->readUInt8();
+
+    if (pointerOffset < start && depth++ < MAX_POINTER_DEPTH) {
+      buffer->mark();
+
+      buffer->setOffset(pointerOffset);
+
+      start = pointerOffset;
+
+      c = buffer->readUInt8();
+    } else {
+      c = END_OF_NAME;
+      valid = false;
+    }
+  }
+
+  return c;
+}
+
+bool Label::Reader::endOfName() {
+  return c == END_OF_NAME && valid;
+}
+
+uint16_t Label::Reader::read(uint8_t * name) {
+  uint16_t length = 0;
+
+  while (hasNext()) {
+    uint8_t size = next();
+
+    if (length < MAX_NAME_SIZE) {
+      name[length] = size;
+    }
+
+    length++;
+
+    for (uint8_t idx = 0; idx < size && buffer->available() > 0; idx++) {
+      uint8_t c = buffer->readUInt8();
+
+      if (length < MAX_NAME_SIZE) {
+        name[length] = c;
+      }
+
+      length++;
+    }
+  }
+
+  buffer->reset();
+
+  return endOfName() && length <= MAX_NAME_SIZE ? length : 0;
+}
+
+bool Label::matches(Buffer * buffer) {
+  uint8_t name[MAX_NAME_SIZE];
+
+  Reader reader(buffer);
+
+  uint16_t length = reader.read(name);
+
+  return length > 0 && equals(name, length);
+}
+
+bool Label::equals(uint8_t * name, uint16_t length) {
+  Label * label = this;
+  uint16_t offset = 0;
+
+  while (label) {
+    uint8_t size = label->data[0] + 1;
+
+    if (offset + size > length || name[offset] != label->data[0]) {
+      return false;
+    }
+
+    for (uint8_t i = 1; i < size; i++) {
+      uint8_t c = name[offset + i];
+      uint8_t d = label->data[i];
+
+      if (c != d && (label->caseSensitive || (c | 0x20) != (d | 0x20) || (c | 0x20) < 'a' || (c | 0x20) > 'z')) {
+        return false;
+      }
+    }
+
+    offset += size;
+    label = label->nextLabel;
+  }
+
+  return offset == length;
+}
+
+bool Label::Matcher::Entry::operator<(const Entry & entry) const {
+  return hash < entry.hash;
+}
+
+uint32_t Label::Matcher::hash(uint32_t hash, uint8_t c) {
+  if (c >= 'A' && c <= 'Z') {
+    c += 32;
+  }
+
+  return (hash ^ c) * FNV_PRIME;
+}
+
+void Label::Matcher::build(std::vector<Label *> & labels) {
+  entries.clear();
+  entries.reserve(labels.size());
+
+  for (std::vector<Label *>::const_iterator i = labels.begin(); i != labels.end(); ++i) {
+    entries.push_back(entry(*i));
+  }
+
+  std::sort(entries.begin(), entries.end());
+}
+
+void Label::Matcher::add(Label * label) {
+  Entry key = entry(label);
+
+  entries.insert(std::upper_bound(entries.begin(), entries.end(), key), key);
+}
+
+void Label::Matcher::remove(Label * label) {
+  Entry key = entry(label);
+
+  std::vector<Entry>::iterator i = std::lower_bound(entries.begin(), entries.end(), key);
+
+  while (i != entries.end() && i->hash == key.hash && i->label != label) {
+    ++i;
+  }
+
+  if (i != entries.end() && i->label == label) {
+    entries.erase(i);
+  }
+}
+
+Label::Matcher::Entry Label::Matcher::entry(Label * label) {
+  Entry entry;
+
+  entry.hash = FNV_OFFSET_BASIS;
+  entry.label = label;
+
+  for (; label != NULL; label = label->nextLabel) {
+    for (uint8_t idx = 0; idx <= label->data[0]; idx++) {
+      entry.hash = hash(entry.hash, label->data[idx]);
+    }
+  }
+
+  return entry;
+}
+
+Label * Label::Matcher::match(Buffer * buffer) {
+  uint8_t name[MAX_NAME_SIZE];
+
+  Reader reader(buffer);
+
+  uint16_t length = reader.read(name);
+
+  Entry key;
+  key.hash = FNV_OFFSET_BASIS;
+
+  for (uint16_t idx = 0; idx < length; idx++) {
+    key.hash = hash(key.hash, name[idx]);
+  }
+
+  Label * label = NULL;
+
+  if (length > 0) {
+    std::vector<Entry>::const_iterator i = std::lower_bound(entries.begin(), entries.end(), key);
+
+    while (label == NULL && i != entries.end() && i->hash == key.hash) {
+      if (i->label->equals(name, length)) {
+        label = i->label;
+      }
+
+      ++i;
+    }
+  }
+
+  return label;
+}
+
+void Label::matched(uint16_t type, uint16_t cls) {
+}
+
+HostLabel::HostLabel(Arena * arena, NSECRecord * nsecRecord, String name, Label * nextLabel, bool caseSensitive):Label(arena, name, nextLabel, caseSensitive) {
+  this->nsecRecord = nsecRecord;
+}
+
+HostLabel::HostLabel(Arena * arena, NSECRecord * nsecRecord, const uint8_t * data, Label * nextLabel, bool caseSensitive):Label(arena, data, nextLabel, caseSensitive) {
+  this->nsecRecord = nsecRecord;
+}
+
+void HostLabel::setAddressRecords(std::vector<Record *> & records) {
+  addressRecords = records;
+
+  nsecRecord->clearTypes();
+
+  for (std::vector<Record *>::const_iterator i = addressRecords.begin(); i != addressRecords.end(); ++i) {
+    nsecRecord->addType((*i)->getType());
+  }
+}
+
+std::vector<Record *> & HostLabel::getAddressRecords() {
+  return addressRecords;
+}
+
+void HostLabel::setAdditionalRecords() {
+  for (std::vector<Record *>::const_iterator i = addressRecords.begin(); i != addressRecords.end(); ++i) {
+    (*i)->setAdditionalRecord();
+  }
+}
+
+// Addresses of the other family go in the additional section, and the NSEC
+// record answers for any type we have no record of.
+void HostLabel::matched(uint16_t type, uint16_t cls) {
+  bool found = false;
+
+  switch(type) {
+    case A_TYPE:
+    case AAAA_TYPE:
+    case ANY_TYPE:
+    for (std::vector<Record *>::const_iterator i = addressRecords.begin(); i != addressRecords.end(); ++i) {
+      if (type == ANY_TYPE || (*i)->getType() == type) {
+        (*i)->setAnswerRecord();
+        found = true;
+      } else {
+        (*i)->setAdditionalRecord();
+      }
+    }
+    break;
+  }
+
+  if (found) {
+    nsecRecord->setAdditionalRecord();
+  } else {
+    nsecRecord->setAnswerRecord();
+  }
+}
+
+ServiceLabel::ServiceLabel(Arena * arena, HostLabel * hostLabel, String name, Label * nextLabel, bool caseSensitive):Label(arena, name, nextLabel, caseSensitive) {
+  this->hostLabel = hostLabel;
+}
+
+ServiceLabel::ServiceLabel(Arena * arena, HostLabel * hostLabel, const uint8_t * data, Label * nextLabel, bool caseSensitive):Label(arena, data, nextLabel, caseSensitive) {
+  this->hostLabel = hostLabel;
+}
+
+void ServiceLabel::addInstance(Record * ptrRecord, Record * srvRecord, Record * txtRecord) {
+  Instance instance = { ptrRecord, srvRecord, txtRecord };
+
+  instances.push_back(instance);
+}
+
+Record * ServiceLabel::removeInstance(Record * srvRecord) {
+  for (std::vector<Instance>::iterator i = instances.begin(); i != instances.end(); ++i) {
+    if (i->srvRecord == srvRecord) {
+      Record * ptrRecord = i->ptrRecord;
+
+      instances.erase(i);
+
+      return ptrRecord;
+    }
+  }
+
+  return NULL;
+}
+
+bool ServiceLabel::hasInstances() {
+  return !instances.empty();
+}
+
+void ServiceLabel::matched(uint16_t type, uint16_t cls) {
+  switch(type) {
+    case PTR_TYPE:
+    case ANY_TYPE:
+    for (std::vector<Instance>::const_iterator i = instances.begin(); i != instances.end(); ++i) {
+      i->ptrRecord->setAnswerRecord();
+      i->srvRecord->setAdditionalRecord();
+      i->txtRecord->setAdditionalRecord();
+    }
+    hostLabel->setAdditionalRecords();
+    break;
+  }
+}
+
+InstanceLabel::InstanceLabel(Arena * arena, HostLabel * hostLabel, String name, Label * nextLabel, bool caseSensitive):Label(arena, name, nextLabel, caseSensitive) {
+  this->hostLabel = hostLabel;
+}
+
+InstanceLabel::InstanceLabel(Arena * arena, HostLabel * hostLabel, const uint8_t * data, Label * nextLabel, bool caseSensitive):Label(arena, data, nextLabel, caseSensitive) {
+  this->hostLabel = hostLabel;
+}
+
+void InstanceLabel::setRecords(Record * srvRecord, Record * txtRecord, Record * nsecRecord) {
+  this->srvRecord = srvRecord;
+  this->txtRecord = txtRecord;
+  this->nsecRecord = nsecRecord;
+}
+
+void InstanceLabel::matched(uint16_t type, uint16_t cls) {
+  switch(type) {
+    case SRV_TYPE:
+    srvRecord->setAnswerRecord();
+    txtRecord->setAdditionalRecord();
+    nsecRecord->setAdditionalRecord();
+    hostLabel->setAdditionalRecords();
+    break;
+
+    case TXT_TYPE:
+    txtRecord->setAnswerRecord();
+    srvRecord->setAdditionalRecord();
+    nsecRecord->setAdditionalRecord();
+    hostLabel->setAdditionalRecords();
+    break;
+
+    case ANY_TYPE:
+    srvRecord->setAnswerRecord();
+    txtRecord->setAnswerRecord();
+    nsecRecord->setAdditionalRecord();
+    hostLabel->setAdditionalRecords();
+    break;
+
+    default:
+    nsecRecord->setAnswerRecord();
+  }
+}
+
+MetaLabel::MetaLabel(Arena * arena, String name, Label * nextLabel, bool caseSensitive):Label(arena, name, nextLabel, caseSensitive) {
+}
+
+MetaLabel::MetaLabel(Arena * arena, const uint8_t * data, Label * nextLabel, bool caseSensitive):Label(arena, data, nextLabel, caseSensitive) {
+}
+
+void MetaLabel::addRecord(Record * record) {
+  records.push_back(record);
+}
+
+void MetaLabel::removeRecord(Record * record) {
+  std::vector<Record *>::iterator i = std::find(records.begin(), records.end(), record);
+
+  if (i != records.end()) {
+    records.erase(i);
+  }
+}
+
+void MetaLabel::matched(uint16_t type, uint16_t cls) {
+  switch(type) {
+    case PTR_TYPE:
+    case ANY_TYPE:
+    for (std::vector<Record *>::const_iterator i = records.begin(); i != records.end(); ++i) {
+      (*i)->setAnswerRecord();
+    }
+    break;
+  }
+}
+
+Packet::Packet(Buffer * buffer) {
+  this->buffer = buffer;
+}
+
+bool Packet::read(bool truncated) {
+  buffer->setOffset(0);
+
+  bool valid = buffer->available() >= HEADER_SIZE;
+
+  for (uint8_t section = 0; section < SECTION_COUNT; section++) {
+    counts[section] = 0;
+  }
+
+  if (valid) {
+    id = buffer->readUInt16();
+    flags = buffer->readUInt16();
+
+    for (uint8_t section = 0; section < SECTION_COUNT; section++) {
+      counts[section] = buffer->readUInt16();
+    }
+  }
+
+  for (uint8_t section = 0; section < SECTION_COUNT; section++) {
+    offsets[section] = buffer->getOffset();
+
+    for (uint16_t i = 0; valid && i < counts[section]; i++) {
+      uint16_t offset = buffer->getOffset();
+
+      if (!readEntry(section)) {
+        valid = truncated;
+
+        counts[section] = i;
+
+        for (uint8_t next = section + 1; next < SECTION_COUNT; next++) {
+          counts[next] = 0;
+        }
+
+        buffer->setOffset(offset);
+      }
+    }
+  }
+
+  buffer->setOffset(offsets[QUESTION_SECTION]);
+
+  return valid;
+}
+
+uint16_t Packet::getId() {
+  return id;
+}
+
+uint16_t Packet::getFlags() {
+  return flags;
+}
+
+bool Packet::isResponse() {
+  return (flags & QR_FLAG) != 0;
+}
+
+uint16_t Packet::getCount(uint8_t section) {
+  return counts[section];
+}
+
+uint16_t Packet::getOffset(uint8_t section) {
+  return offsets[section];
+}
+
+bool Packet::readName() {
+  uint16_t start = buffer->getOffset();
+  uint16_t end = 0;
+  uint16_t length = 0;
+  uint8_t depth = 0;
+  bool valid = true;
+  bool done = false;
+
+  while (valid && !done) {
+    valid = buffer->available() > 0;
+
+    uint8_t c = buffer->readUInt8();
+
+    if ((c & LABEL_POINTER) == LABEL_POINTER) {
+      valid = valid && buffer->available() > 0;
+
+      uint16_t pointerOffset = ((c & ~LABEL_POINTER) << 8) | buffer->readUInt8();
+
+      if (end == 0) {
+        end = buffer->getOffset();
+      }
+
+      valid = valid && pointerOffset >= HEADER_SIZE && pointerOffset < start && depth++ < MAX_POINTER_DEPTH;
+
+      start = pointerOffset;
+
+      buffer->setOffset(pointerOffset);
+    } else if ((c & LABEL_POINTER) != 0) {
+      valid = false;
+    } else {
+      length += c + 1;
+
+      valid = valid && length <= MAX_NAME_SIZE && buffer->available() >= c;
+
+      buffer->setOffset(buffer->getOffset() + (valid? c : 0));
+
+      done = c == END_OF_NAME;
+    }
+  }
+
+  if (valid && end != 0) {
+    buffer->setOffset(end);
+  }
+
+  return valid;
+}
+
+bool Packet::readEntry(uint8_t section) {
+  bool valid = readName();
+
+  if (section == QUESTION_SECTION) {
+    valid = valid && buffer->available() >= 4;
+
+    buffer->setOffset(buffer->getOffset() + (valid? 4 : 0));
+  } else {
+    valid = valid && buffer->available() >= 10;
+
+    buffer->setOffset(buffer->getOffset() + (valid? 8 : 0));
+
+    uint16_t length = valid? buffer->readUInt16() : 0;
+
+    valid = valid && buffer->available() >= length;
+
+    buffer->setOffset(buffer->getOffset() + (valid? length : 0));
+  }
+
+  return valid;
+}
+
+MDNS::MDNS(uint16_t arenaSize) : arena(new Arena(arenaSize)) {
+}
+
+#if PLATFORM_THREADING
+MDNS::~MDNS() {
+  stopThread();
+}
+#endif
+
+bool MDNS::setHostname(String hostname) {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    Change change = { CHANGE_SET_HOSTNAME, "", "", hostname };
+
+    return queueChange(change);
+  }
+#endif
+
+  bool success = true;
+
+  if (hostLabel != NULL) {
+    status = "Hostname already set";
+    success = false;
+  }
+
+  if (success && hostname.length() < MAX_LABEL_SIZE && isAlphaDigitHyphen(hostname)) {
+    NSECRecord * hostNSECRecord = new (arena) NSECRecord();
+
+    addHost(new (arena) HostLabel(arena, hostNSECRecord, hostname, LOCAL), hostNSECRecord);
+  } else {
+    if (success) {
+      status = "Invalid hostname";
+    }
+
+    success = false;
+  }
+
+  return success;
+}
+
+bool MDNS::addService(String protocol, String service, uint16_t port, String instance, std::vector<String> subServices) {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    Change change = { CHANGE_ADD_SERVICE, protocol, service, instance, port, subServices };
+
+    return queueChange(change);
+  }
+#endif
+
+  bool success = true;
+
+  if (hostLabel == NULL) {
+    status = "Hostname not set";
+    success = false;
+  }
+
+  if (success && findInstance(protocol, service, instance) != NULL) {
+    status = "Service already added";
+    success = false;
+  }
+
+  bool validSubServices = true;
+
+  for (std::vector<String>::const_iterator i = subServices.begin(); validSubServices && i != subServices.end(); ++i) {
+    validSubServices = i->length() > 0 && i->length() < MAX_LABEL_SIZE - 1 && isAlphaDigitHyphen(*i);
+  }
+
+  if (success && protocol.length() < MAX_LABEL_SIZE - 1 && service.length() < MAX_LABEL_SIZE - 1 &&
+  instance.length() < MAX_LABEL_SIZE && isAlphaDigitHyphen(protocol) && isAlphaDigitHyphen(service) && isNetUnicode(instance) &&
+  validSubServices) {
+
+    String serviceString = "_" + service + "._" + protocol;
+
+    ServiceLabel * serviceLabel = (ServiceLabel *) findLabel(serviceString);
+
+    if (serviceLabel == NULL) {
+      Label * protocolLabel = intern(new (arena) Label(arena, "_" + protocol, LOCAL));
+
+      serviceLabel = new (arena) ServiceLabel(arena, hostLabel, "_" + service, protocolLabel);
+
+      addLabel(serviceLabel);
+    }
+
+    std::vector<ServiceLabel *> subServiceLabels;
+
+    for (std::vector<String>::const_iterator i = subServices.begin(); i != subServices.end(); ++i) {
+      ServiceLabel * subServiceLabel = (ServiceLabel *) findLabel("_" + *i + "._sub." + serviceString);
+
+      if (subServiceLabel == NULL) {
+        subServiceLabel = new (arena) ServiceLabel(arena, hostLabel, "_" + *i, intern(new (arena) Label(arena, SUB_LABEL.data, serviceLabel)));
+
+        addLabel(subServiceLabel);
+      }
+
+      subServiceLabels.push_back(subServiceLabel);
+    }
+
+    InstanceLabel * instanceLabel = new (arena) InstanceLabel(arena, hostLabel, instance, serviceLabel, true);
+
+    txtRecord = addInstance(instanceLabel, serviceLabel, subServiceLabels.data(), subServiceLabels.size(), port);
+  } else {
+    if (success) {
+      status = "Invalid name";
+    }
+
+    success = false;
+  }
+
+  return success;
+}
+
+// Names and TXT data are borrowed from the configuration rather than copied,
+// and no String is built on the way.
+bool MDNS::addService(const StaticService & service) {
+  bool success = true;
+
+  if (hostLabel == NULL) {
+    status = "Hostname not set";
+    success = false;
+  }
+
+  ServiceLabel * serviceLabel = success? (ServiceLabel *) findLabel(service.service, service.protocol, LOCAL) : NULL;
+
+  if (serviceLabel != NULL && findLabel(service.instance, service.service, serviceLabel->getNextLabel()) != NULL) {
+    status = "Service already added";
+    success = false;
+  }
+
+  bool valid = isAlphaDigitHyphen(service.protocol, true) && isAlphaDigitHyphen(service.service, true) && isNetUnicode(service.instance);
+
+  for (uint8_t i = 0; valid && i < service.subServiceCount; i++) {
+    valid = isAlphaDigitHyphen(service.subServices[i], true);
+  }
+
+  if (success && !valid) {
+    status = "Invalid name";
+    success = false;
+  }
+
+  if (success) {
+    if (serviceLabel == NULL) {
+      Label * protocolLabel = intern(new (arena) Label(arena, service.protocol, LOCAL));
+
+      serviceLabel = new (arena) ServiceLabel(arena, hostLabel, service.service, protocolLabel);
+
+      addLabel(serviceLabel);
+    }
+
+    ServiceLabel ** subServiceLabels = service.subServiceCount > 0? (ServiceLabel **) arena->allocate(service.subServiceCount * sizeof(ServiceLabel *)) : NULL;
+    uint8_t subServiceCount = subServiceLabels != NULL? service.subServiceCount : 0;
+
+    for (uint8_t i = 0; i < subServiceCount; i++) {
+      ServiceLabel * subServiceLabel = (ServiceLabel *) findLabel(service.subServices[i], SUB_LABEL.data, serviceLabel);
+
+      if (subServiceLabel == NULL) {
+        subServiceLabel = new (arena) ServiceLabel(arena, hostLabel, service.subServices[i], intern(new (arena) Label(arena, SUB_LABEL.data, serviceLabel)));
+
+        addLabel(subServiceLabel);
+      }
+
+      subServiceLabels[i] = subServiceLabel;
+    }
+
+    InstanceLabel * instanceLabel = new (arena) InstanceLabel(arena, hostLabel, service.instance, serviceLabel, true);
+
+    TXTRecord * txtRecord = addInstance(instanceLabel, serviceLabel, subServiceLabels, subServiceCount, service.port);
+
+    txtRecord->setData(service.txt, service.txtSize);
+
+    arena->release(subServiceLabels);
+  }
+
+  return success;
+}
+
+void MDNS::addHost(HostLabel * label, NSECRecord * nsecRecord) {
+  records.push_back(nsecRecord);
+
+  hostLabel = label;
+
+  addLabel(hostLabel);
+
+  nsecRecord->setLabel(hostLabel);
+
+  Probe probe = { hostLabel, NULL, true, 0, false, false };
+
+  probes.push_back(probe);
+}
+
+// The records of a new instance, its PTR records under the service and its
+// subtypes, and the enumeration PTR the first time the service is seen.
+TXTRecord * MDNS::addInstance(InstanceLabel * instanceLabel, ServiceLabel * serviceLabel, ServiceLabel ** subServiceLabels, uint8_t subServiceCount, uint16_t port) {
+  PTRRecord * ptrRecord = new (arena) PTRRecord();
+  SRVRecord * srvRecord = new (arena) SRVRecord();
+  TXTRecord * txtRecord = new (arena) TXTRecord(arena);
+  NSECRecord * instanceNSECRecord = new (arena) NSECRecord();
+
+  records.push_back(ptrRecord);
+  records.push_back(srvRecord);
+  records.push_back(txtRecord);
+  records.push_back(instanceNSECRecord);
+
+  serviceLabel->addInstance(ptrRecord, srvRecord, txtRecord);
+
+  invalidateResponses(serviceLabel);
+
+  if (enumerationLabel == NULL) {
+    enumerationLabel = new (arena) MetaLabel(arena, SERVICES_LABEL.data, new (arena) Label(arena, DNS_SD_LABEL.data, intern(new (arena) Label(arena, UDP_LABEL.data, LOCAL))));
+
+    addLabel(enumerationLabel);
+  }
+
+  if (findPointer(enumerationLabel, serviceLabel) == NULL) {
+    PTRRecord * enumerationRecord = new (arena) PTRRecord();
+
+    enumerationRecord->setLabel(enumerationLabel);
+    enumerationRecord->setInstanceLabel(serviceLabel);
+
+    records.push_back(enumerationRecord);
+
+    enumerationLabel->addRecord(enumerationRecord);
+
+    invalidateResponses(enumerationLabel);
+
+    announce(enumerationRecord);
+  }
+
+  instanceLabel->setRecords(srvRecord, txtRecord, instanceNSECRecord);
+
+  addLabel(instanceLabel);
+
+  for (uint8_t i = 0; i < subServiceCount; i++) {
+    PTRRecord * subPTRRecord = new (arena) PTRRecord();
+
+    subPTRRecord->setLabel(subServiceLabels[i]);
+    subPTRRecord->setInstanceLabel(instanceLabel);
+
+    records.push_back(subPTRRecord);
+
+    subServiceLabels[i]->addInstance(subPTRRecord, srvRecord, txtRecord);
+
+    invalidateResponses(subServiceLabels[i]);
+
+    announce(subPTRRecord);
+  }
+
+  ptrRecord->setLabel(serviceLabel);
+  ptrRecord->setInstanceLabel(instanceLabel);
+  srvRecord->setLabel(instanceLabel);
+  srvRecord->setPort(port);
+  srvRecord->setHostLabel(hostLabel);
+  txtRecord->setLabel(instanceLabel);
+  instanceNSECRecord->setLabel(instanceLabel);
+  instanceNSECRecord->addType(TXT_TYPE);
+  instanceNSECRecord->addType(SRV_TYPE);
+
+  Probe probe = { instanceLabel, NULL, false, 0, false, false };
+
+  probes.push_back(probe);
+
+  announce(ptrRecord);
+  announce(srvRecord);
+  announce(txtRecord);
+
+  if (state >= STATE_PROBING) {
+    setState(STATE_PROBING, random(PROBE_INTERVAL));
+  }
+
+  return txtRecord;
+}
+
+void MDNS::addTXTEntry(String key, String value) {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    Change change = { CHANGE_ADD_TXT_ENTRY };
+
+    change.entries.push_back(key);
+    change.entries.push_back(value);
+
+    queueChange(change);
+    return;
+  }
+#endif
+
+  if (txtRecord != NULL) {
+    txtRecord->addEntry(key, value);
+
+    invalidateResponses(txtRecord);
+  }
+}
+
+// Goodbye records with a TTL of zero go out straight away, so peers drop the
+// instance instead of keeping it cached for up to 75 minutes.
+bool MDNS::removeService(String protocol, String service, String instance) {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    Change change = { CHANGE_REMOVE_SERVICE, protocol, service, instance };
+
+    return queueChange(change);
+  }
+#endif
+
+  Label * label = findInstance(protocol, service, instance);
+
+  if (label == NULL) {
+    status = "Service not found";
+    return false;
+  }
+
+  Record * srvRecord = findRecord(label, SRV_TYPE);
+  std::vector<Record *> removed;
+  std::vector<Label *> removedLabels(1, label);
+
+  for (std::vector<Record *>::const_iterator i = records.begin(); i != records.end(); ++i) {
+    if ((*i)->getType() == PTR_TYPE && ((PTRRecord *) *i)->getInstanceLabel() == label) {
+      ServiceLabel * serviceLabel = (ServiceLabel *) (*i)->getLabel();
+      Record * enumerationRecord = findPointer(enumerationLabel, serviceLabel);
+
+      serviceLabel->removeInstance(srvRecord);
+
+      invalidateResponses(serviceLabel);
+
+      removed.push_back(*i);
+
+      if (!serviceLabel->hasInstances()) {
+        removedLabels.push_back(serviceLabel);
+      }
+
+      if (enumerationRecord != NULL && !serviceLabel->hasInstances()) {
+        enumerationLabel->removeRecord(enumerationRecord);
+
+        invalidateResponses(enumerationLabel);
+
+        removed.push_back(enumerationRecord);
+      }
+    } else if ((*i)->getLabel() == label) {
+      removed.push_back(*i);
+    }
+  }
+
+  bool verified = false;
+
+  for (std::vector<Probe>::iterator probe = probes.begin(); probe != probes.end(); ++probe) {
+    if (probe->label == label) {
+      verified = probe->verified;
+
+      arena->release(probe->name);
+
+      probes.erase(probe);
+      break;
+    }
+  }
+
+  if (verified && state > STATE_PROBING) {
+    writeRecords(removed, 0);
+  }
+
+  for (std::vector<Record *>::const_iterator i = removed.begin(); i != removed.end(); ++i) {
+    invalidateResponses(*i);
+
+    records.erase(*i);
+
+    std::vector<Record *>::iterator announcement = std::find(announcements.begin(), announcements.end(), *i);
+
+    if (announcement != announcements.end()) {
+      announcements.erase(announcement);
+    }
+
+    if (*i == txtRecord) {
+      txtRecord = NULL;
+    }
+
+    arena->destroy(*i);
+  }
+
+  removeLabels(removedLabels);
+
+  return true;
+}
+
+bool MDNS::updateTXT(String protocol, String service, String instance, std::vector<String> entries) {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    Change change = { CHANGE_UPDATE_TXT, protocol, service, instance, 0, entries };
+
+    return queueChange(change);
+  }
+#endif
+
+  Label * label = findInstance(protocol, service, instance);
+  TXTRecord * record = label != NULL ? (TXTRecord *) findRecord(label, TXT_TYPE) : NULL;
+
+  if (record == NULL) {
+    status = "Service not found";
+    return false;
+  }
+
+  record->setEntries(entries);
+
+  invalidateResponses(record);
+
+  announce(record);
+
+  if (state == STATE_ANNOUNCING || state == STATE_RUNNING) {
+    setState(STATE_ANNOUNCING, 0);
+  }
+
+  return true;
+}
+
+bool MDNS::setPort(String protocol, String service, String instance, uint16_t port) {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    Change change = { CHANGE_SET_PORT, protocol, service, instance, port };
+
+    return queueChange(change);
+  }
+#endif
+
+  Label * label = findInstance(protocol, service, instance);
+  SRVRecord * record = label != NULL ? (SRVRecord *) findRecord(label, SRV_TYPE) : NULL;
+
+  if (record == NULL) {
+    status = "Service not found";
+    return false;
+  }
+
+  record->setPort(port);
+
+  invalidateResponses(record);
+
+  announce(record);
+
+  if (state == STATE_ANNOUNCING || state == STATE_RUNNING) {
+    setState(STATE_ANNOUNCING, 0);
+  }
+
+  return true;
+}
+
+// Startup does not block: processQueries opens the socket once WiFi is
+// ready, then probes for our unique names and announces them.
+bool MDNS::begin() {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    status = "Responder thread running";
+    return false;
+  }
+#endif
+
+  matcher->build(labels);
+
+  state = STATE_STARTING;
+
+  return true;
+}
+
+// A configuration fixed at build time. Its names and TXT data stay where
+// they are, and the bookkeeping is sized once up front.
+bool MDNS::begin(const StaticConfiguration & configuration) {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    status = "Responder thread running";
+    return false;
+  }
+#endif
+
+  size_t recordCount = 1;
+  size_t labelCount = 2;
+
+  for (uint8_t i = 0; i < configuration.serviceCount; i++) {
+    recordCount += 5 + configuration.services[i].subServiceCount;
+    labelCount += 3 + configuration.services[i].subServiceCount;
+  }
+
+  records.reserve(recordCount);
+  labels.reserve(labelCount);
+  probes.reserve(configuration.serviceCount + 1);
+  announcements.reserve(recordCount);
+
+  bool success = hostLabel == NULL;
+
+  if (!success) {
+    status = "Hostname already set";
+  } else if (!isAlphaDigitHyphen(configuration.hostname, false)) {
+    status = "Invalid hostname";
+    success = false;
+  } else {
+    NSECRecord * hostNSECRecord = new (arena) NSECRecord();
+
+    addHost(new (arena) HostLabel(arena, hostNSECRecord, configuration.hostname, LOCAL), hostNSECRecord);
+  }
+
+  for (uint8_t i = 0; success && i < configuration.serviceCount; i++) {
+    success = addService(configuration.services[i]);
+  }
+
+  return success && begin();
+}
+
+bool MDNS::processQueries() {
+  return processQueries(1).processed > 0;
+}
+
+MDNS::MemoryUsage MDNS::memoryUsage() {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    std::lock_guard<std::mutex> lock(snapshotLock);
+
+    return snapshot.usage;
+  }
+#endif
+
+  MemoryUsage usage;
+
+  usage.arenaSize = arena->getSize();
+  usage.arenaUsed = arena->getUsed();
+  usage.heapUsed = arena->getHeapUsed();
+  usage.labels = labels.size();
+  usage.records = records.size();
+
+  return usage;
+}
+
+MDNS::RateLimits MDNS::rateLimits() {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    std::lock_guard<std::mutex> lock(snapshotLock);
+
+    return snapshot.limits;
+  }
+#endif
+
+  return limits;
+}
+
+#if MDNS_STATS
+MDNS::Stats MDNS::stats() {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    std::lock_guard<std::mutex> lock(snapshotLock);
+
+    return snapshot.stats;
+  }
+#endif
+
+  return counters;
+}
+
+void MDNS::resetStats() {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    Change change = { CHANGE_RESET_STATS };
+
+    queueChange(change);
+    return;
+  }
+#endif
+
+  counters = Stats();
+}
+
+uint32_t MDNS::addSample(uint32_t * histogram, uint32_t ticks) {
+  uint32_t elapsed = ticks / System.ticksPerMicrosecond();
+  uint8_t bucket = elapsed > 0 ? 32 - __builtin_clz(elapsed) : 0;
+
+  histogram[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+
+  return ticks;
+}
+#endif
+
+String MDNS::getStatus() {
+  return status.load();
+}
+
+MDNS::Batch MDNS::processQueries(uint16_t maxPackets, uint32_t maxMicros) {
+  Batch batch = { 0, 0 };
+
+#if PLATFORM_THREADING
+  // The responder thread does this on its own.
+  if (isQueued()) {
+    return batch;
+  }
+#endif
+
+  unsigned long start = micros();
+
+  if (!updateNetwork()) {
+    return batch;
+  }
+
+  bool more = true;
+
+  while (more && batch.processed + batch.dropped < maxPackets && (maxMicros == 0 || micros() - start < maxMicros)) {
+    int n = udp->parsePacket();
+
+    if (n > 0 && processPacket(n)) {
+      batch.processed++;
+    } else if (n > 0) {
+      batch.dropped++;
+    } else {
+      more = false;
+    }
+  }
+
+  updateTimers();
+
+  return batch;
+}
+
+void MDNS::processTimers() {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    return;
+  }
+#endif
+
+  if (updateNetwork()) {
+    updateTimers();
+  }
+}
+
+// Incoming packets are not covered: they are for the application to wait on,
+// alongside this deadline.
+unsigned long MDNS::getNextDeadline() {
+  unsigned long now = millis();
+
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    return now + QUERY_MAX_INTERVAL;
+  }
+#endif
+
+  if (state == STATE_STOPPED) {
+    return now + QUERY_MAX_INTERVAL;
+  } else if (state == STATE_STARTING) {
+    return WiFi.ready() ? now : now + START_RETRY_INTERVAL;
+  } else if (deferred || WiFi.localIP() != cachedIP) {
+    return now;
+  }
+
+  long delay = (long) (addressTime + ADDRESS_REFRESH_INTERVAL - now);
+
+  for (std::vector<Probe>::const_iterator probe = probes.begin(); probe != probes.end(); ++probe) {
+    if (probe->conflict) {
+      return now;
+    }
+  }
+
+  if (state != STATE_RUNNING) {
+    delay = std::min(delay, (long) (stateTime - now));
+  }
+
+  if (pending) {
+    delay = std::min(delay, (long) (pendingTime - now));
+  }
+
+  for (std::vector<Question>::const_iterator i = questions.begin(); i != questions.end(); ++i) {
+    delay = std::min(delay, (long) (i->time - now));
+  }
+
+  for (std::vector<CacheEntry>::const_iterator i = cache.begin(); i != cache.end(); ++i) {
+    delay = std::min(delay, (long) (i->time + i->ttl * 1000 - now));
+
+    if (i->refreshes < CACHE_REFRESH_COUNT) {
+      delay = std::min(delay, (long) (i->time + i->ttl * 10 * (CACHE_REFRESH_PERCENT + CACHE_REFRESH_STEP * i->refreshes) - now));
+    }
+  }
+
+  return now + delay;
+}
+
+#if PLATFORM_THREADING
+bool MDNS::startThread() {
+  if (thread != NULL) {
+    status = "Thread already started";
+    return false;
+  }
+
+  cacheChanged = true;
+
+  publish();
+
+  running = true;
+  thread = new Thread("mdns", run, this, OS_THREAD_PRIORITY_DEFAULT, RESPONDER_STACK_SIZE);
+
+  return true;
+}
+
+// Changes still queued are applied before returning, on the caller's thread.
+void MDNS::stopThread() {
+  Thread * responder = thread;
+
+  if (responder != NULL) {
+    running = false;
+    responder->join();
+
+    thread = NULL;
+    delete responder;
+
+    applyChanges();
+  }
+}
+
+MDNS::Change::Change(uint8_t type, String protocol, String service, String instance, uint16_t port, std::vector<String> entries, BrowseCallback callback) {
+  this->type = type;
+  this->protocol = protocol;
+  this->service = service;
+  this->instance = instance;
+  this->port = port;
+  this->entries = entries;
+  this->callback = callback;
+}
+
+// Until the thread is stored, or on the thread itself, calls run directly.
+bool MDNS::isQueued() {
+  Thread * responder = thread;
+
+  return responder != NULL && !responder->is_current();
+}
+
+bool MDNS::queueChange(const Change & change) {
+  uint32_t tail = changeTail.load(std::memory_order_relaxed);
+
+  if (tail - changeHead.load(std::memory_order_acquire) >= CHANGE_QUEUE_SIZE) {
+    status = "Change queue full";
+    return false;
+  }
+
+  changes[tail % CHANGE_QUEUE_SIZE] = change;
+
+  changeTail.store(tail + 1, std::memory_order_release);
+
+  return true;
+}
+
+void MDNS::applyChanges() {
+  uint32_t head = changeHead.load(std::memory_order_relaxed);
+
+  while (head != changeTail.load(std::memory_order_acquire)) {
+    Change & change = changes[head % CHANGE_QUEUE_SIZE];
+    IPAddress address;
+
+    switch (change.type) {
+      case CHANGE_ADD_SERVICE:
+        addService(change.protocol, change.service, change.port, change.instance, change.entries);
+        break;
+
+      case CHANGE_ADD_TXT_ENTRY:
+        addTXTEntry(change.entries[0], change.entries[1]);
+        break;
+
+      case CHANGE_REMOVE_SERVICE:
+        removeService(change.protocol, change.service, change.instance);
+        break;
+
+      case CHANGE_UPDATE_TXT:
+        updateTXT(change.protocol, change.service, change.instance, change.entries);
+        break;
+
+      case CHANGE_SET_PORT:
+        setPort(change.protocol, change.service, change.instance, change.port);
+        break;
+
+      case CHANGE_BROWSE:
+        browse(change.service, change.protocol, change.callback);
+        break;
+
+      case CHANGE_RESOLVE:
+        resolve(change.instance, address);
+        break;
+
+      case CHANGE_SET_HOSTNAME:
+        setHostname(change.instance);
+        break;
+
+      case CHANGE_SET_BUFFER_SIZE:
+        setBufferSize(change.port);
+        break;
+
+#if MDNS_STATS
+      case CHANGE_RESET_STATS:
+        resetStats();
+        break;
+#endif
+    }
+
+    // The strings are released here, so the slot holds nothing once the
+    // application can reuse it.
+    change = Change();
+
+    changeHead.store(++head, std::memory_order_release);
+  }
+}
+
+void MDNS::publish() {
+  MemoryUsage usage = memoryUsage();
+
+  std::lock_guard<std::mutex> lock(snapshotLock);
+
+  snapshot.usage = usage;
+  snapshot.limits = limits;
+#if MDNS_STATS
+  snapshot.stats = counters;
+#endif
+
+  if (cacheChanged) {
+    snapshot.addresses.clear();
+
+    for (std::vector<CacheEntry>::const_iterator i = cache.begin(); i != cache.end(); ++i) {
+      if (i->type == A_TYPE) {
+        ResolvedAddress resolved = { i->name, IPAddress(i->address[0], i->address[1], i->address[2], i->address[3]), i->time + i->ttl * 1000 };
+
+        snapshot.addresses.push_back(resolved);
+      }
+    }
+
+    cacheChanged = false;
+  }
+}
+
+// Addresses come from the last snapshot. A name not in it is queued for the
+// responder to ask about, again at most every RESOLVE_RETRY_INTERVAL.
+bool MDNS::resolvePublished(String name, IPAddress & address) {
+  {
+    std::lock_guard<std::mutex> lock(snapshotLock);
+
+    for (std::vector<ResolvedAddress>::const_iterator i = snapshot.addresses.begin(); i != snapshot.addresses.end(); ++i) {
+      if (i->name.equalsIgnoreCase(name) && (long) (i->expiry - millis()) > 0) {
+        address = i->address;
+        return true;
+      }
+    }
+  }
+
+  std::vector<std::pair<String, unsigned long> >::iterator request = resolving.begin();
+
+  while (request != resolving.end() && !request->first.equalsIgnoreCase(name)) {
+    ++request;
+  }
+
+  if (request != resolving.end() && millis() - request->second < RESOLVE_RETRY_INTERVAL) {
+    return false;
+  }
+
+  Change change = { CHANGE_RESOLVE, "", "", name };
+
+  if (!queueChange(change)) {
+    return false;
+  }
+
+  if (request != resolving.end()) {
+    request->second = millis();
+  } else {
+    resolving.push_back(std::make_pair(name, millis()));
+  }
+
+  return false;
+}
+
+// Wakes at the next deadline, or after a fixed interval well inside the 20
+// to 120 ms response delay if that comes first, since UDP cannot block until
+// a packet arrives.
+os_thread_return_t MDNS::run(void * mdns) {
+  MDNS * responder = (MDNS *) mdns;
+  system_tick_t wakeTime = millis();
+
+  while (responder->running) {
+    responder->applyChanges();
+    responder->processQueries(RESPONDER_BATCH_SIZE);
+    responder->publish();
+
+    long delay = (long) (responder->getNextDeadline() - millis());
+
+    os_thread_delay_until(&wakeTime, delay > 0 && delay < RESPONDER_INTERVAL ? delay : RESPONDER_INTERVAL);
+  }
+
+  os_thread_exit(NULL);
+}
+#endif
+
+bool MDNS::browse(String service, String protocol, BrowseCallback callback) {
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    Change change = { CHANGE_BROWSE, protocol, service, "", 0, std::vector<String>(), callback };
+
+    return queueChange(change);
+  }
+#endif
+
+  if (callback == NULL || service.length() >= MAX_LABEL_SIZE - 1 || protocol.length() >= MAX_LABEL_SIZE - 1 ||
+  !isAlphaDigitHyphen(service) || !isAlphaDigitHyphen(protocol)) {
+    status = "Invalid name";
+    return false;
+  }
+
+  String name = "_" + service + "._" + protocol + ".local";
+  Question * question = findQuestion(name, PTR_TYPE);
+
+  if (question != NULL) {
+    question->callback = callback;
+  } else {
+    ask(name, PTR_TYPE, callback);
+  }
+
+  return true;
+}
+
+// Answers come from the cache while they are valid. Otherwise a query is
+// sent and the address becomes available once a response arrives.
+bool MDNS::resolve(String hostname, IPAddress & address) {
+  String name = hostname.endsWith(".local") ? hostname : hostname + ".local";
+
+#if PLATFORM_THREADING
+  if (isQueued()) {
+    return resolvePublished(name, address);
+  }
+#endif
+
+  CacheEntry * entry = findEntry(name, A_TYPE);
+
+  if (entry != NULL) {
+    address = IPAddress(entry->address[0], entry->address[1], entry->address[2], entry->address[3]);
+    return true;
+  }
+
+  if (findQuestion(name, A_TYPE) == NULL) {
+    ask(name, A_TYPE, NULL);
+  }
+
+  return false;
+}
+
+bool MDNS::processPacket(uint16_t size) {
+  buffer->read(udp);
+
+  udp->flush();
+
+  bool valid = packet->read(size > buffer->available());
+
+  STATS_COUNT(packetsReceived, 1);
+  STATS_COUNT(malformedPackets, !valid);
+
+  if (valid && !packet->isResponse() && isThrottled(udp->remoteIP())) {
+    limits.throttledQueries++;
+    valid = false;
+  }
+
+  if (valid) {
+    getResponses();
+
+    buffer->clear();
+
+    scheduleResponses();
+  }
+
+  buffer->clear();
+
+  return valid;
+}
+
+void MDNS::getResponses() {
+  keyed = false;
+  matched = false;
+
+  if (!packet->isResponse() && state == STATE_PROBING) {
+    getProbeConflicts();
+
+    buffer->setOffset(packet->getOffset(QUESTION_SECTION));
+  }
+
+  if (!packet->isResponse()) {
+    uint16_t count = packet->getCount(QUESTION_SECTION);
+
+    legacy = udp->remotePort() != MDNS_PORT;
+    unicast = count > 0;
+    probe = packet->getCount(AUTHORITY_SECTION) > 0;
+
+    for (uint16_t i = 0; i < count; i++) {
+      STATS_START(matchStart);
+
+      Label * label = matcher->match(buffer);
+
+      STATS_SAMPLE(matchMicros, matchStart);
+      STATS_COUNT(questions, 1);
+      STATS_COUNT(matchedQuestions, label != NULL);
+      STATS_COUNT(unmatchedQuestions, label == NULL);
+
+      uint16_t type = buffer->readUInt16();
+      uint16_t cls = buffer->readUInt16();
+
+      unicast = unicast && (cls & QU_FLAG);
+
+      if (label != NULL && count == 1 && !legacy && state != STATE_PROBING) {
+        responseKey = ResponseKey(label, type);
+        keyed = true;
+      } else if (label != NULL) {
+        label->matched(type, cls);
+      }
+
+      matched = matched || label != NULL;
+    }
+
+    unicast = unicast || legacy;
+
+    if (matched && getKnownAnswers(packet->getCount(ANSWER_SECTION), false) && keyed) {
+      responseKey.first->matched(responseKey.second, IN_CLASS);
+      keyed = false;
+    }
+  } else {
+    getConflicts();
+
+    if ((!questions.empty() || !cache.empty()) && udp->remotePort() == MDNS_PORT) {
+      getAnswers();
+    }
+
+    if (pending) {
+      buffer->setOffset(packet->getOffset(ANSWER_SECTION));
+
+      getKnownAnswers(packet->getCount(ANSWER_SECTION), true);
+    }
+  }
+}
+
+// Until a name is verified, any record for it is a conflict unless it is
+// identical to ours. Afterwards only a record of the same type with different
+// data is.
+void MDNS::getConflicts() {
+  uint16_t count = packet->getCount(ANSWER_SECTION) + packet->getCount(AUTHORITY_SECTION) + packet->getCount(ADDITIONAL_SECTION);
+
+  buffer->setOffset(packet->getOffset(ANSWER_SECTION));
+
+  for (uint16_t n = 0; n < count; n++) {
+    Label * label = matcher->match(buffer);
+
+    uint16_t type = buffer->readUInt16();
+    buffer->readUInt16();
+    uint32_t ttl = buffer->readUInt32();
+    uint16_t length = buffer->readUInt16();
+    uint16_t offset = buffer->getOffset();
+
+    for (std::vector<Probe>::iterator probe = probes.begin(); label != NULL && ttl > 0 && probe != probes.end(); ++probe) {
+      if (probe->label != label) {
+        continue;
+      }
+
+      bool identical = false;
+      bool sameType = records.find(label, type) >= 0;
+
+      for (int32_t n = records.find(label, type); !identical && n >= 0; n = records.find(label, type, n + 1)) {
+        buffer->setOffset(offset);
+
+        identical = records[n]->matches(label, type, buffer, length);
+      }
+
+      probe->conflict = probe->conflict || (!identical && (!probe->verified || sameType));
+    }
+
+    buffer->setOffset(offset + length);
+  }
+}
+
+// Simultaneous probes are resolved as in RFC 6762 section 8.2: the sorted
+// record sets in the authority sections are compared, and the host whose
+// set is lexicographically earlier defers and probes again.
+void MDNS::getProbeConflicts() {
+  for (std::vector<Probe>::iterator probe = probes.begin(); probe != probes.end(); ++probe) {
+    std::vector<std::vector<uint8_t> > theirs;
+
+    if (probe->verified) {
+      continue;
+    }
+
+    uint16_t count = packet->getCount(AUTHORITY_SECTION);
+
+    buffer->setOffset(packet->getOffset(AUTHORITY_SECTION));
+
+    for (uint16_t n = 0; n < count; n++) {
+      Label * label = matcher->match(buffer);
+
+      uint16_t type = buffer->readUInt16();
+      uint16_t cls = buffer->readUInt16() & ~CACHE_FLUSH_FLAG;
+      buffer->readUInt32();
+      uint16_t length = buffer->readUInt16();
+      uint16_t offset = buffer->getOffset();
+
+      if (label == probe->label) {
+        uint8_t name[MAX_NAME_SIZE];
+        uint16_t fixed = type == SRV_TYPE ? 6 : type == PTR_TYPE ? 0 : length;
+
+        theirs.push_back(std::vector<uint8_t>());
+
+        std::vector<uint8_t> & data = theirs.back();
+
+        data.push_back(cls >> 8);
+        data.push_back(cls);
+        data.push_back(type >> 8);
+        data.push_back(type);
+
+        for (uint16_t i = 0; i < fixed && i < length; i++) {
+          data.push_back(buffer->readUInt8());
+        }
+
+        if (fixed < length) {
+          uint16_t size = Label::read(buffer, name);
+
+          data.insert(data.end(), name, name + size);
+        }
+      }
+
+      buffer->setOffset(offset + length);
+    }
+
+    if (!theirs.empty()) {
+      std::vector<std::vector<uint8_t> > ours;
+
+      getRecordData(probe->label, ours);
+
+      std::sort(theirs.begin(), theirs.end());
+      std::sort(ours.begin(), ours.end());
+
+      deferred = deferred || ours < theirs;
+    }
+  }
+}
+
+// Record data is written without name compression, as the tie-break compares
+// it byte for byte.
+void MDNS::getRecordData(Label * label, std::vector<std::vector<uint8_t> > & data) {
+  Buffer scratch(buffer->getSize());
+
+  for (std::vector<Record *>::const_iterator i = records.begin(); i != records.end(); ++i) {
+    if ((*i)->getLabel() == label && (*i)->getType() != NSEC_TYPE) {
+      scratch.clear();
+      scratch.writeUInt16(IN_CLASS);
+      scratch.writeUInt16((*i)->getType());
+
+      (*i)->writeData(&scratch);
+
+      data.push_back(std::vector<uint8_t>());
+
+      scratch.copy(data.back());
+
+      // Drop the RDLENGTH that precedes the data.
+      data.back().erase(data.back().begin() + 4, data.back().begin() + 6);
+    }
+  }
+}
+
+// Opens the socket once WiFi is ready and keeps our addresses current.
+// Returns whether the responder is past starting.
+bool MDNS::updateNetwork() {
+  if (state == STATE_STARTING && WiFi.ready()) {
+    udp->begin(MDNS_PORT);
+    udp->joinMulticast(IPAddress(224, 0, 0, 251));
+
+    setState(STATE_PROBING, random(PROBE_INTERVAL));
+  }
+
+  if (state < STATE_PROBING) {
+    return false;
+  }
+
+  IPAddress ip = WiFi.localIP();
+
+  if (ip != cachedIP || millis() - addressTime >= ADDRESS_REFRESH_INTERVAL) {
+    cachedIP = ip;
+    addressTime = millis();
+
+    if (updateAddresses() && state > STATE_PROBING) {
+      for (std::vector<Probe>::iterator probe = probes.begin(); probe != probes.end(); ++probe) {
+        probe->verified = false;
+      }
+
+      for (std::vector<Record *>::const_iterator i = records.begin(); i != records.end(); ++i) {
+        announce(*i);
+      }
+
+      setState(STATE_PROBING, 0);
+    }
+  }
+
+  return true;
+}
+
+void MDNS::updateTimers() {
+  updateState();
+
+  if (!questions.empty() || !cache.empty()) {
+    updateCache();
+    writeQueries();
+  }
+
+  if (pending && (long) (millis() - pendingTime) >= 0) {
+    writePendingResponse();
+  }
+}
+
+void MDNS::updateState() {
+  bool conflicted = false;
+
+  for (std::vector<Probe>::iterator probe = probes.begin(); probe != probes.end(); ++probe) {
+    if (probe->conflict) {
+      rename(*probe);
+
+      probe->conflict = false;
+      probe->verified = false;
+      conflicted = true;
+    }
+  }
+
+  if (conflicted) {
+    responses.clear();
+
+    for (std::vector<Record *>::const_iterator i = records.begin(); i != records.end(); ++i) {
+      announce(*i);
+    }
+
+    setState(STATE_PROBING, 0);
+  } else if (deferred) {
+    setState(STATE_PROBING, PROBE_DEFER_DELAY);
+  }
+
+  deferred = false;
+
+  if ((long) (millis() - stateTime) < 0) {
+    return;
+  }
+
+  if (state == STATE_PROBING && stateCount < PROBE_COUNT) {
+    writeProbes(stateCount == 0);
+
+    stateCount++;
+    stateTime = millis() + PROBE_INTERVAL;
+  } else if (state == STATE_PROBING) {
+    for (std::vector<Probe>::iterator probe = probes.begin(); probe != probes.end(); ++probe) {
+      probe->verified = true;
+    }
+
+    setState(STATE_ANNOUNCING, 0);
+  }
+
+  if (state == STATE_ANNOUNCING && (long) (millis() - stateTime) >= 0) {
+    writeRecords(announcements, TTL_MAX);
+
+    stateCount++;
+    stateTime = millis() + ANNOUNCE_INTERVAL;
+
+    if (stateCount >= ANNOUNCE_COUNT) {
+      announcements.clear();
+
+      setState(STATE_RUNNING, 0);
+    }
+  }
+}
+
+void MDNS::setState(uint8_t state, unsigned long delay) {
+  this->state = state;
+  this->stateCount = 0;
+  this->stateTime = millis() + delay;
+}
+
+// Without the interface API only the IPv4 address WiFi reports is known.
+void MDNS::readAddresses(std::vector<Address> & addresses) {
+  bool ipv4 = false;
+
+#if HAL_PLATFORM_IFAPI
+  if_list * interfaces = NULL;
+
+  if (if_get_list(&interfaces) == 0) {
+    for (if_list * i = interfaces; i != NULL; i = i->next) {
+      if_addrs * ifAddresses = NULL;
+
+      if (if_get_addrs(i->iface, &ifAddresses) != 0) {
+        continue;
+      }
+
+      for (if_addrs * a = ifAddresses; a != NULL; a = a->next) {
+        sockaddr * addr = a->if_addr->addr;
+        Address address;
+
+        if (addr->sa_family == AF_INET) {
+          const uint8_t * data = (const uint8_t *) &((sockaddr_in *) addr)->sin_addr;
+
+          address.type = A_TYPE;
+          memcpy(address.data, data, IP_SIZE);
+
+          if (data[0] != 127) {
+            addresses.push_back(address);
+            ipv4 = true;
+          }
+        } else if (addr->sa_family == AF_INET6) {
+          const uint8_t * data = (const uint8_t *) &((sockaddr_in6 *) addr)->sin6_addr;
+          static const uint8_t loopback[IPV6_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+
+          address.type = AAAA_TYPE;
+          memcpy(address.data, data, IPV6_SIZE);
+
+          if (memcmp(data, loopback, IPV6_SIZE) != 0) {
+            addresses.push_back(address);
+          }
+        }
+      }
+
+      if_free_if_addrs(ifAddresses);
+    }
+
+    if_free_list(interfaces);
+  }
+#endif
+
+  IPAddress ip = WiFi.localIP();
+
+  if (!ipv4 && ip) {
+    Address address;
+
+    address.type = A_TYPE;
+
+    for (int i = 0; i < IP_SIZE; i++) {
+      address.data[i] = ip[i];
+    }
+
+    addresses.push_back(address);
+  }
+}
+
+// Address records are rebuilt only when the set of addresses changes, so
+// responses never have to ask the interface for them. Addresses that went
+// away, and their reverse names, get a goodbye before the new set is
+// announced.
+bool MDNS::updateAddresses() {
+  if (hostLabel == NULL) {
+    return false;
+  }
+
+  std::vector<Address> addresses;
+
+  readAddresses(addresses);
+
+  std::vector<Record *> current = hostLabel->getAddressRecords();
+  bool changed = addresses.size() != current.size();
+
+  for (size_t i = 0; !changed && i < addresses.size(); i++) {
+    changed = !((AddressRecord *) current[i])->hasAddress(addresses[i].type, addresses[i].data);
+  }
+
+  if (changed) {
+    std::vector<Record *> updated;
+    std::vector<Record *> goodbyes;
+
+    for (size_t i = 0; state > STATE_PROBING && i < current.size(); i++) {
+      bool kept = false;
+
+      for (std::vector<Address>::const_iterator a = addresses.begin(); !kept && a != addresses.end(); ++a) {
+        kept = ((AddressRecord *) current[i])->hasAddress(a->type, a->data);
+      }
+
+      if (!kept) {
+        goodbyes.push_back(current[i]);
+
+        if (i < reverseRecords.size()) {
+          goodbyes.push_back(reverseRecords[i]);
+        }
+      }
+    }
+
+    if (!goodbyes.empty()) {
+      writeRecords(goodbyes, 0);
+    }
+
+    removeReverseRecords();
+
+    for (std::vector<Record *>::const_iterator i = current.begin(); i != current.end(); ++i) {
+      records.erase(*i);
+
+      std::vector<Record *>::iterator announcement = std::find(announcements.begin(), announcements.end(), *i);
+
+      if (announcement != announcements.end()) {
+        announcements.erase(announcement);
+      }
+
+      arena->destroy(*i);
+    }
+
+    for (std::vector<Address>::const_iterator i = addresses.begin(); i != addresses.end(); ++i) {
+      AddressRecord * record = i->type == A_TYPE ? (AddressRecord *) new (arena) ARecord() : (AddressRecord *) new (arena) AAAARecord();
+
+      record->setLabel(hostLabel);
+      record->setAddress(i->data);
+
+      records.push_back(record);
+      updated.push_back(record);
+
+      announce(record);
+
+      addReverseRecord(i->type, i->data);
+    }
+
+    hostLabel->setAddressRecords(updated);
+
+    responses.clear();
+  }
+
+  return changed;
+}
+
+// Records are cached while something asked for them: a browsed service
+// type, the instances it lists, the hosts those point to, and resolved names.
+void MDNS::getAnswers() {
+  uint16_t count = packet->getCount(ANSWER_SECTION) + packet->getCount(AUTHORITY_SECTION) + packet->getCount(ADDITIONAL_SECTION);
+
+  buffer->setOffset(packet->getOffset(ANSWER_SECTION));
+
+  for (uint16_t n = 0; n < count; n++) {
+    CacheEntry entry;
+
+    entry.name = readName();
+    entry.type = buffer->readUInt16();
+
+    uint16_t cls = buffer->readUInt16();
+
+    entry.ttl = buffer->readUInt32();
+
+    uint16_t length = buffer->readUInt16();
+    uint16_t offset = buffer->getOffset();
+
+    if ((cls & ~CACHE_FLUSH_FLAG) == IN_CLASS && (isInteresting(entry.name, entry.type) || findEntry(entry.name, entry.type) != NULL)) {
+      entry.port = 0;
+
+      memset(entry.address, 0, sizeof(entry.address));
+
+      if (entry.type == PTR_TYPE) {
+        entry.target = readName();
+      } else if (entry.type == SRV_TYPE && length > 6) {
+        buffer->readUInt16();
+        buffer->readUInt16();
+        entry.port = buffer->readUInt16();
+        entry.target = readName();
+      } else if (entry.type == A_TYPE && length == IP_SIZE) {
+        for (uint8_t i = 0; i < IP_SIZE; i++) {
+          entry.address[i] = buffer->readUInt8();
+        }
+      } else {
+        entry.type = 0;
+      }
+
+      if (entry.type != 0) {
+        cacheAnswer(entry, (cls & CACHE_FLUSH_FLAG) != 0);
+      }
+    }
+
+    buffer->setOffset(offset + length);
+  }
+}
+
+bool MDNS::isInteresting(String name, uint16_t type) {
+  uint16_t targetType = type == SRV_TYPE ? PTR_TYPE : type == A_TYPE ? SRV_TYPE : 0;
+
+  for (std::vector<CacheEntry>::const_iterator i = cache.begin(); targetType != 0 && i != cache.end(); ++i) {
+    if (i->type == targetType && i->target.equalsIgnoreCase(name)) {
+      return true;
+    }
+  }
+
+  return findQuestion(name, type) != NULL;
+}
+
+// A TTL of zero is a goodbye, kept for one more second as RFC 6762 section
+// 10.1 asks. The cache-flush bit does the same for other records of the
+// set that are more than a second old.
+void MDNS::cacheAnswer(CacheEntry & entry, bool cacheFlush) {
+  unsigned long now = millis();
+  cacheChanged = true;
+  bool goodbye = entry.ttl == 0;
+  CacheEntry * existing = NULL;
+
+  entry.ttl = goodbye ? GOODBYE_TTL : entry.ttl < CACHE_MAX_TTL ? entry.ttl : CACHE_MAX_TTL;
+  entry.time = now;
+  entry.refreshes = goodbye ? CACHE_REFRESH_COUNT : 0;
+  entry.reported = false;
+  entry.resolving = false;
+
+  for (std::vector<CacheEntry>::iterator i = cache.begin(); i != cache.end(); ++i) {
+    if (i->type != entry.type || !i->name.equalsIgnoreCase(entry.name)) {
+      continue;
+    }
+
+    bool same = entry.type == PTR_TYPE ? i->target.equalsIgnoreCase(entry.target) :
+      entry.type == A_TYPE ? memcmp(i->address, entry.address, IP_SIZE) == 0 : true;
+
+    if (same) {
+      existing = &*i;
+    } else if (cacheFlush && now - i->time > CACHE_FLUSH_DELAY) {
+      i->ttl = GOODBYE_TTL;
+      i->time = now;
+      i->refreshes = CACHE_REFRESH_COUNT;
+    }
+  }
+
+  if (existing != NULL && goodbye) {
+    existing->ttl = GOODBYE_TTL;
+    existing->time = now;
+    existing->refreshes = CACHE_REFRESH_COUNT;
+  } else if (existing != NULL) {
+    entry.reported = existing->reported && existing->target.equalsIgnoreCase(entry.target);
+
+    *existing = entry;
+  } else if (!goodbye) {
+    if (cache.size() >= QUERY_CACHE_SIZE) {
+      std::vector<CacheEntry>::iterator oldest = cache.begin();
+
+      for (std::vector<CacheEntry>::iterator i = cache.begin(); i != cache.end(); ++i) {
+        if (i->ttl * 1000 - (now - i->time) < oldest->ttl * 1000 - (now - oldest->time)) {
+          oldest = i;
+        }
+      }
+
+      cache.erase(oldest);
+    }
+
+    cache.push_back(entry);
+  }
+
+  for (std::vector<Question>::iterator i = questions.begin(); !goodbye && i != questions.end(); ++i) {
+    if (i->callback == NULL && i->type == entry.type && i->name.equalsIgnoreCase(entry.name)) {
+      questions.erase(i);
+      break;
+    }
+  }
+}
+
+// Expires cached records, queries again at 80, 85, 90 and 95% of the TTL
+// for records still in use, and reports instances to browse callbacks once
+// their SRV record is known. If it did not come along it is asked for once
+// each time the PTR record is received, so an instance that never answers is
+// not queried for ever.
+void MDNS::updateCache() {
+  struct Report {
+    BrowseCallback callback;
+    String instance;
+    String host;
+    uint16_t port;
+    bool available;
+  };
+
+  std::vector<Report> reports;
+  unsigned long now = millis();
+
+  for (std::vector<CacheEntry>::iterator i = cache.begin(); i != cache.end();) {
+    unsigned long age = now - i->time;
+
+    if (age >= i->ttl * 1000) {
+      Question * question = i->type == PTR_TYPE && i->reported ? findQuestion(i->name, PTR_TYPE) : NULL;
+
+      if (question != NULL && question->callback != NULL) {
+        Report report = { question->callback, unescape(i->target.substring(0, i->target.length() - i->name.length() - 1)), "", 0, false };
+
+        reports.push_back(report);
+      }
+
+      i = cache.erase(i);
+      cacheChanged = true;
+      continue;
+    }
+
+    // A refresh point passes whether or not anyone still wants the answer,
+    // so it is not due again on every call.
+    if (i->refreshes < CACHE_REFRESH_COUNT && age >= i->ttl * 10 * (CACHE_REFRESH_PERCENT + CACHE_REFRESH_STEP * i->refreshes)) {
+      if (isInteresting(i->name, i->type)) {
+        Question * question = findQuestion(i->name, i->type);
+
+        if (question == NULL) {
+          ask(i->name, i->type, NULL);
+        } else if ((long) (question->time - now) > 0) {
+          question->time = now;
+        }
+      }
+
+      i->refreshes++;
+    }
+
+    ++i;
+  }
+
+  for (std::vector<CacheEntry>::iterator i = cache.begin(); i != cache.end(); ++i) {
+    Question * question = i->type == PTR_TYPE && !i->reported ? findQuestion(i->name, PTR_TYPE) : NULL;
+
+    if (question == NULL || question->callback == NULL) {
+      continue;
+    }
+
+    CacheEntry * srvEntry = findEntry(i->target, SRV_TYPE);
+
+    if (srvEntry != NULL) {
+      Report report = { question->callback, unescape(i->target.substring(0, i->target.length() - i->name.length() - 1)), srvEntry->target, srvEntry->port, true };
+
+      reports.push_back(report);
+
+      i->reported = true;
+    } else if (!i->resolving) {
+      i->resolving = true;
+
+      if (findQuestion(i->target, SRV_TYPE) == NULL) {
+        ask(i->target, SRV_TYPE, NULL);
+      }
+    }
+  }
+
+  for (std::vector<Report>::const_iterator i = reports.begin(); i != reports.end(); ++i) {
+    i->callback(i->instance, i->host, i->port, i->available);
+  }
+}
+
+// Due questions go out in one packet, followed by the PTR records we already
+// hold with more than half their TTL left, so responders can leave them out.
+// Each question is asked again at double the interval; one-shot questions
+// are dropped after QUERY_ATTEMPTS tries.
+void MDNS::writeQueries() {
+  unsigned long now = millis();
+  std::vector<std::pair<Question *, uint16_t> > asked;
+
+  for (std::vector<Question>::iterator i = questions.begin(); i != questions.end();) {
+    if (i->callback == NULL && i->count >= QUERY_ATTEMPTS && (long) (now - i->time) >= 0) {
+      i = questions.erase(i);
+    } else {
+      ++i;
+    }
+  }
+
+  buffer->clear();
+  buffer->setOffset(HEADER_SIZE);
+
+  for (std::vector<Question>::iterator i = questions.begin(); i != questions.end(); ++i) {
+    if ((long) (now - i->time) < 0 || (i->callback == NULL && i->count >= QUERY_ATTEMPTS)) {
+      continue;
+    }
+
+    uint16_t offset = buffer->getOffset();
+
+    writeName(i->name);
+    buffer->writeUInt16(i->type);
+    buffer->writeUInt16(IN_CLASS);
+
+    if (buffer->overflow()) {
+      buffer->rewind(offset);
+      break;
+    }
+
+    i->count++;
+    i->time = now + i->interval;
+    i->interval = i->interval < QUERY_MAX_INTERVAL / 2 ? i->interval * 2 : QUERY_MAX_INTERVAL;
+
+    asked.push_back(std::make_pair(&*i, offset));
+  }
+
+  uint16_t answerCount = 0;
+
+  for (std::vector<std::pair<Question *, uint16_t> >::const_iterator q = asked.begin(); q != asked.end(); ++q) {
+    for (std::vector<CacheEntry>::const_iterator i = cache.begin(); q->first->type == PTR_TYPE && i != cache.end(); ++i) {
+      uint32_t age = (now - i->time) / 1000;
+
+      if (i->type != PTR_TYPE || !i->name.equalsIgnoreCase(q->first->name) || age >= i->ttl / 2) {
+        continue;
+      }
+
+      uint16_t offset = buffer->getOffset();
+
+      buffer->writeUInt16((LABEL_POINTER << 8) | q->second);
+      buffer->writeUInt16(PTR_TYPE);
+      buffer->writeUInt16(IN_CLASS);
+      buffer->writeUInt32(i->ttl - age);
+
+      uint16_t lengthOffset = buffer->getOffset();
+
+      buffer->writeUInt16(0);
+      writeName(i->target);
+
+      if (buffer->overflow()) {
+        buffer->rewind(offset);
+        break;
+      }
+
+      uint16_t end = buffer->getOffset();
+
+      buffer->setOffset(lengthOffset);
+      buffer->writeUInt16(end - lengthOffset - 2);
+      buffer->setOffset(end);
+
+      answerCount++;
+    }
+  }
+
+  if (!asked.empty()) {
+    uint16_t size = buffer->getOffset();
+
+    buffer->setOffset(0);
+    buffer->writeUInt16(0x0);
+    buffer->writeUInt16(0x0);
+    buffer->writeUInt16(asked.size());
+    buffer->writeUInt16(answerCount);
+    buffer->writeUInt16(0x0);
+    buffer->writeUInt16(0x0);
+    buffer->setOffset(size);
+
+    udp->beginPacket(IPAddress(224, 0, 0, 251), MDNS_PORT);
+
+    buffer->write(udp);
+
+    udp->endPacket();
+  }
+
+  buffer->clear();
+}
+
+void MDNS::ask(String name, uint16_t type, BrowseCallback callback) {
+  Question question = { name, type, callback, millis() + random(QUERY_MIN_DELAY, QUERY_MAX_DELAY), QUERY_INTERVAL, 0 };
+
+  questions.push_back(question);
+}
+
+MDNS::Question * MDNS::findQuestion(String name, uint16_t type) {
+  for (std::vector<Question>::iterator i = questions.begin(); i != questions.end(); ++i) {
+    if (i->type == type && i->name.equalsIgnoreCase(name)) {
+      return &*i;
+    }
+  }
+
+  return NULL;
+}
+
+MDNS::CacheEntry * MDNS::findEntry(String name, uint16_t type) {
+  for (std::vector<CacheEntry>::iterator i = cache.begin(); i != cache.end(); ++i) {
+    if (i->type == type && i->name.equalsIgnoreCase(name)) {
+      return &*i;
+    }
+  }
+
+  return NULL;
+}
+
+// Names of remote records are kept as text, with a dot or backslash inside a
+// label escaped by a backslash as RFC 6763 section 4.3 describes, so an
+// instance such as "Living Rm. Printer" keeps its labels.
+String MDNS::readName() {
+  uint8_t name[MAX_NAME_SIZE];
+  uint16_t length = Label::read(buffer, name);
+  String result;
+
+  for (uint16_t offset = 0; offset < length && name[offset] != END_OF_NAME; offset += name[offset] + 1) {
+    if (offset > 0) {
+      result += DOT;
+    }
+
+    for (uint8_t i = 1; i <= name[offset]; i++) {
+      if (name[offset + i] == DOT || name[offset + i] == BACKSLASH) {
+        result += BACKSLASH;
+      }
+
+      result += (char) name[offset + i];
+    }
+  }
+
+  return result;
+}
+
+void MDNS::writeName(String name) {
+  uint8_t label[MAX_LABEL_SIZE];
+  uint8_t length = 0;
+
+  for (unsigned int i = 0; i <= name.length(); i++) {
+    char c = i < name.length() ? name.charAt(i) : DOT;
+
+    if (c == BACKSLASH && i + 1 < name.length()) {
+      c = name.charAt(++i);
+    } else if (c == DOT) {
+      buffer->writeUInt8(length);
+      buffer->writeBytes(label, length);
+
+      length = 0;
+      continue;
+    }
+
+    if (length < MAX_LABEL_SIZE) {
+      label[length++] = c;
+    }
+  }
+
+  buffer->writeUInt8(END_OF_NAME);
+}
+
+String MDNS::unescape(String name) {
+  String result;
+
+  for (unsigned int i = 0; i < name.length(); i++) {
+    if (name.charAt(i) == BACKSLASH && i + 1 < name.length()) {
+      i++;
+    }
+
+    result += name.charAt(i);
+  }
+
+  return result;
+}
+
+// Reverse names are built one label per octet, or per nibble for IPv6,
+// below in-addr.arpa and ip6.arpa, with the PTR on the last label.
+void MDNS::addReverseRecord(uint16_t type, const uint8_t * address) {
+  static const char HEX[] = "0123456789abcdef";
+  uint8_t family = type == A_TYPE ? 0 : 1;
+
+  if (reverseLabels[family] == NULL) {
+    Label * arpaLabel = new (arena) Label(arena, "arpa", ROOT);
+
+    reverseLabels[0] = new (arena) Label(arena, "in-addr", arpaLabel);
+    reverseLabels[1] = new (arena) Label(arena, "ip6", arpaLabel);
+  }
+
+  std::vector<String> names;
+  char name[4];
+
+  for (uint8_t i = 0; i < (family == 0 ? IP_SIZE : IPV6_SIZE); i++) {
+    if (family == 0) {
+      snprintf(name, sizeof(name), "%u", address[i]);
+      names.push_back(name);
+    } else {
+      names.push_back(String(HEX[address[i] >> 4]));
+      names.push_back(String(HEX[address[i] & 0x0f]));
+    }
+  }
+
+  Label * label = reverseLabels[family];
+
+  for (size_t i = 0; i < names.size() - 1; i++) {
+    label = new (arena) Label(arena, names[i], label);
+
+    reverseNames.push_back(label);
+  }
+
+  MetaLabel * reverseLabel = new (arena) MetaLabel(arena, names.back(), label);
+  PTRRecord * reverseRecord = new (arena) PTRRecord(false);
+
+  reverseRecord->setLabel(reverseLabel);
+  reverseRecord->setInstanceLabel(hostLabel);
+
+  reverseLabel->addRecord(reverseRecord);
+
+  reverseNames.push_back(reverseLabel);
+  reverseRecords.push_back(reverseRecord);
+  records.push_back(reverseRecord);
+
+  addLabel(reverseLabel);
+
+  announce(reverseRecord);
+}
+
+void MDNS::removeReverseRecords() {
+  for (std::vector<Record *>::const_iterator i = reverseRecords.begin(); i != reverseRecords.end(); ++i) {
+    Label * label = (*i)->getLabel();
+
+    records.erase(*i);
+
+    std::vector<Record *>::iterator announcement = std::find(announcements.begin(), announcements.end(), *i);
+
+    if (announcement != announcements.end()) {
+      announcements.erase(announcement);
+    }
+
+    matcher->remove(label);
+
+    labels.erase(std::find(labels.begin(), labels.end(), label));
+
+    arena->destroy(*i);
+  }
+
+  for (std::vector<Label *>::const_iterator i = reverseNames.begin(); i != reverseNames.end(); ++i) {
+    arena->destroy(*i);
+  }
+
+  reverseRecords.clear();
+  reverseNames.clear();
+}
+
+Record * MDNS::findPointer(Label * label, Label * target) {
+  for (int32_t n = records.find(label, PTR_TYPE); label != NULL && n >= 0; n = records.find(label, PTR_TYPE, n + 1)) {
+    if (((PTRRecord *) records[n])->getInstanceLabel() == target) {
+      return records[n];
+    }
+  }
+
+  return NULL;
+}
+
+void MDNS::rename(Probe & probe) {
+  char suffix[12];
+
+  probe.conflicts++;
+
+  snprintf(suffix, sizeof(suffix), probe.host ? "-%u" : " (%u)", probe.conflicts + 1);
+
+  uint8_t length = strlen(suffix);
+
+  if (probe.name == NULL) {
+    String original = probe.label->getName();
+
+    probe.name = (char *) arena->allocate(original.length() + 1);
+
+    if (probe.name != NULL) {
+      memcpy(probe.name, original.c_str(), original.length() + 1);
+    }
+  }
+
+  String name = probe.name != NULL ? String(probe.name) : probe.label->getName();
+
+  if (name.length() + length >= MAX_LABEL_SIZE) {
+    name = name.substring(0, MAX_LABEL_SIZE - 1 - length);
+  }
+
+  matcher->remove(probe.label);
+
+  probe.label->setName(name + suffix);
+
+  matcher->add(probe.label);
+
+  status = "Renamed after a name conflict";
+}
+
+void MDNS::addLabel(Label * label) {
+  labels.push_back(label);
+
+  if (state != STATE_STOPPED) {
+    matcher->add(label);
+  }
+}
+
+// The instance and any service or subtype name it leaves without instances
+// go, and with them the suffixes no other name ends in.
+void MDNS::removeLabels(std::vector<Label *> & removed) {
+  for (std::vector<Label *>::const_iterator i = removed.begin(); i != removed.end(); ++i) {
+    matcher->remove(*i);
 
-      for (uint8_t i = 0; i < labels.size(); i++) {
-        iterators[i]->match(c);
-      }
+    labels.erase(std::find(labels.begin(), labels.end(), *i));
+
+    invalidateResponses(*i);
 
-      idx++;
+    if (pendingKeyed && pendingKey.first == *i) {
+      pending = false;
+      pendingKeyed = false;
     }
   }
 
+  std::vector<Label *> suffixes;
 
-  buffer->reset();
+  for (std::vector<Label *>::const_iterator i = removed.begin(); i != removed.end(); ++i) {
+    for (Label * suffix = (*i)->getNextLabel(); suffix != NULL && suffix != LOCAL; suffix = suffix->getNextLabel()) {
+      if (std::find(removed.begin(), removed.end(), suffix) == removed.end() &&
+      std::find(suffixes.begin(), suffixes.end(), suffix) == suffixes.end() && !isSuffix(suffix)) {
+        suffixes.push_back(suffix);
+      }
+    }
+  }
 
-  Label * label = NULL;
+  for (std::vector<Label *>::const_iterator i = removed.begin(); i != removed.end(); ++i) {
+    arena->destroy(*i);
+  }
 
-  if (reader->endOfName()) {
-    uint8_t idx = 0;
+  for (std::vector<Label *>::const_iterator i = suffixes.begin(); i != suffixes.end(); ++i) {
+    arena->destroy(*i);
+  }
+}
 
-    while (label == NULL && idx < labels.size()) {
-      if (iterators[idx]->matched()) {
-        label = iterators[idx]->getStartLabel();
+bool MDNS::isSuffix(Label * label) {
+  for (std::vector<Label *>::const_iterator i = labels.begin(); i != labels.end(); ++i) {
+    for (Label * suffix = *i; suffix != NULL; suffix = suffix->getNextLabel()) {
+      if (suffix == label) {
+        return true;
       }
-
-      idx++;
     }
   }
 
-  for (uint8_t i = 0; i < labels.size(); i++) {
-    delete iterators[i];
-  }
+  return false;
+}
+
+// Suffixes such as _tcp.local or _sub._http._tcp.local are created once and
+// shared by every name that ends in them.
+Label * MDNS::intern(Label * label) {
+  for (std::vector<Label *>::const_iterator i = labels.begin(); i != labels.end(); ++i) {
+    for (Label * suffix = (*i)->getNextLabel(); suffix != NULL; suffix = suffix->getNextLabel()) {
+      if (suffix != label && suffix->equals(label)) {
+        arena->destroy(label);
 
-  delete reader;
+        return suffix;
+      }
+    }
+  }
 
   return label;
 }
 
-void Label::matched(uint16_t type, uint16_t cls) {
+Label * MDNS::findInstance(String protocol, String service, String instance) {
+  return findLabel(instance + "._" + service + "._" + protocol);
 }
 
-HostLabel::HostLabel(Record * aRecord, Record * nsecRecord, String name, Label * nextLabel, bool caseSensitive):Label(name, nextLabel, caseSensitive) {
-  this->aRecord = aRecord;
-  this->nsecRecord = nsecRecord;
+Label * MDNS::findLabel(String name) {
+  name += ".local";
+
+  for (std::vector<Label *>::const_iterator i = labels.begin(); i != labels.end(); ++i) {
+    if ((*i)->equals(name)) {
+      return *i;
+    }
+  }
+
+  return NULL;
 }
 
-void HostLabel::matched(uint16_t type, uint16_t cls) {
-  switch(type) {
-    case A_TYPE:
-    case ANY_TYPE:
-    aRecord->setAnswerRecord();
-    nsecRecord->setAdditionalRecord();
-    break;
+Label * MDNS::findLabel(const uint8_t * name, const uint8_t * parentName, Label * grandparent) {
+  for (std::vector<Label *>::const_iterator i = labels.begin(); i != labels.end(); ++i) {
+    Label * parent = (*i)->getNextLabel();
 
-    default:
-    nsecRecord->setAnswerRecord();
+    if (parent != NULL && parent->getNextLabel() == grandparent && (*i)->equals(name) && parent->equals(parentName)) {
+      return *i;
+    }
   }
+
+  return NULL;
 }
 
-ServiceLabel::ServiceLabel(Record * aRecord, String name, Label * nextLabel, bool caseSensitive):Label(name, nextLabel, caseSensitive) {
-  this->aRecord = aRecord;
+Record * MDNS::findRecord(Label * label, uint16_t type) {
+  int32_t n = records.find(label, type);
+
+  return n >= 0 ? records[n] : NULL;
 }
 
-void ServiceLabel::addInstance(Record * ptrRecord, Record * srvRecord, Record * txtRecord) {
-    ptrRecords.push_back(ptrRecord);
-    srvRecords.push_back(srvRecord);
-    txtRecords.push_back(txtRecord);
+void MDNS::announce(Record * record) {
+  if (record->getType() != NSEC_TYPE && std::find(announcements.begin(), announcements.end(), record) == announcements.end()) {
+    announcements.push_back(record);
+  }
 }
 
-void ServiceLabel::matched(uint16_t type, uint16_t cls) {
-  switch(type) {
-    case PTR_TYPE:
-    case ANY_TYPE:
-    for (std::vector<Record *>::const_iterator i = ptrRecords.begin(); i != ptrRecords.end(); ++i) {
-      (*i)->setAnswerRecord();
-    }
-    for (std::vector<Record *>::const_iterator i = srvRecords.begin(); i != srvRecords.end(); ++i) {
-      (*i)->setAdditionalRecord();
-    }
-    for (std::vector<Record *>::const_iterator i = txtRecords.begin(); i != txtRecords.end(); ++i) {
-      (*i)->setAdditionalRecord();
+void MDNS::invalidateResponses(Label * label) {
+  std::map<ResponseKey, CachedResponse>::iterator i = responses.begin();
+
+  while (i != responses.end()) {
+    if (i->first.first == label) {
+      responses.erase(i++);
+    } else {
+      ++i;
     }
-    aRecord->setAdditionalRecord();
-    break;
   }
 }
 
-InstanceLabel::InstanceLabel(Record * srvRecord, Record * txtRecord, Record * nsecRecord, Record * aRecord, String name, Label * nextLabel, bool caseSensitive):Label(name, nextLabel, caseSensitive) {
-  this->srvRecord = srvRecord;
-  this->txtRecord = txtRecord;
-  this->nsecRecord = nsecRecord;
-  this->aRecord = aRecord;
+void MDNS::invalidateResponses(Record * record) {
+  std::map<ResponseKey, CachedResponse>::iterator i = responses.begin();
+
+  while (i != responses.end()) {
+    if (std::find(i->second.records.begin(), i->second.records.end(), record) != i->second.records.end()) {
+      responses.erase(i++);
+    } else {
+      ++i;
+    }
+  }
 }
 
-void InstanceLabel::matched(uint16_t type, uint16_t cls) {
-  switch(type) {
-    case SRV_TYPE:
-    srvRecord->setAnswerRecord();
-    txtRecord->setAdditionalRecord();
-    nsecRecord->setAdditionalRecord();
-    aRecord->setAdditionalRecord();
-    break;
+bool MDNS::getKnownAnswers(uint16_t count, bool duplicates) {
+  bool known = false;
 
-    case TXT_TYPE:
-    txtRecord->setAnswerRecord();
-    srvRecord->setAdditionalRecord();
-    nsecRecord->setAdditionalRecord();
-    aRecord->setAdditionalRecord();
-    break;
+  for (uint16_t n = 0; n < count; n++) {
+    Label * label = matcher->match(buffer);
 
-    case ANY_TYPE:
-    srvRecord->setAnswerRecord();
-    txtRecord->setAnswerRecord();
-    nsecRecord->setAdditionalRecord();
-    aRecord->setAdditionalRecord();
-    break;
+    uint16_t type = buffer->readUInt16();
+    buffer->readUInt16();
+    uint32_t ttl = buffer->readUInt32();
+    uint16_t length = buffer->readUInt16();
+    uint16_t offset = buffer->getOffset();
 
-    default:
-    nsecRecord->setAnswerRecord();
+    for (int32_t idx = records.find(label, type); label != NULL && idx >= 0; idx = records.find(label, type, idx + 1)) {
+      Record * record = records[idx];
+
+      if (record->matches(label, type, buffer, length) && ttl >= (duplicates ? record->getTTL() : record->getTTL() / 2)) {
+        if (duplicates) {
+          schedulePendingKey();
+          record->setDuplicateRecord();
+
+          STATS_COUNT(duplicateAnswers, 1);
+        } else {
+          record->setKnownRecord();
+
+          STATS_COUNT(knownAnswers, 1);
+        }
+
+        known = true;
+      }
+
+      buffer->setOffset(offset);
+    }
+
+    buffer->setOffset(offset + length);
   }
+
+  return known;
 }
 
-bool MDNS::setHostname(String hostname) {
-  bool success = true;
-  String status = "Ok";
+void MDNS::scheduleResponses() {
+  if (!matched) {
+    return;
+  }
 
-  if (labels[HOSTNAME]) {
-    status = "Hostname already set";
-    success = false;
+  if (unicast) {
+    writeUnicastResponse();
+    return;
   }
 
-  if (success && hostname.length() < MAX_LABEL_SIZE && isAlphaDigitHyphen(hostname)) {
-    aRecord = new ARecord();
+  pendingProbe = pendingProbe || probe;
 
-    HostNSECRecord * hostNSECRecord = new HostNSECRecord();
+  if (keyed) {
+    std::map<ResponseKey, CachedResponse>::iterator i = responses.find(responseKey);
 
-    records.push_back(aRecord);
-    records.push_back(hostNSECRecord);
+    if (i == responses.end() && (!pending || pendingKeyed)) {
+      i = cacheResponse(responseKey);
+    }
 
-    Label * label = new HostLabel(aRecord, hostNSECRecord, hostname, LOCAL);
+    if (!pending) {
+      pending = true;
+      pendingKeyed = true;
+      pendingKey = responseKey;
+      pendingTime = millis() + (i->second.shared ? random(SHARED_RESPONSE_MIN_DELAY, SHARED_RESPONSE_MAX_DELAY) : 0);
+      return;
+    }
 
-    labels[HOSTNAME] = label;
+    if (pendingKeyed && pendingKey == responseKey) {
+      return;
+    }
 
-    aRecord->setLabel(label);
-    hostNSECRecord->setLabel(label);
-  } else {
-    status = success? "Invalid hostname" : status;
-    success = false;
+    responseKey.first->matched(responseKey.second, IN_CLASS);
   }
 
-  return success;
+  bool shared = scheduleRecords();
+
+  schedulePendingKey();
+
+  if (!pending) {
+    pending = true;
+    pendingTime = millis() + (shared ? random(SHARED_RESPONSE_MIN_DELAY, SHARED_RESPONSE_MAX_DELAY) : 0);
+  }
 }
 
-bool MDNS::addService(String protocol, String service, uint16_t port, String instance, std::vector<String> subServices) {
-  bool success = true;
-  String status = "Ok";
+bool MDNS::scheduleRecords() {
+  return records.schedule();
+}
 
-  if (!labels[HOSTNAME]) {
-    status = "Hostname not set";
-    success = false;
+void MDNS::schedulePendingKey() {
+  if (pendingKeyed) {
+    pendingKey.first->matched(pendingKey.second, IN_CLASS);
+
+    scheduleRecords();
+
+    pendingKeyed = false;
   }
+}
 
-  if (success && protocol.length() < MAX_LABEL_SIZE - 1 && service.length() < MAX_LABEL_SIZE - 1 &&
-  instance.length() < MAX_LABEL_SIZE && isAlphaDigitHyphen(protocol) && isAlphaDigitHyphen(service) && isNetUnicode(instance)) {
+// Each source gets SOURCE_MAX_QUERIES queries per window. The table only
+// tracks the most recently active sources.
+bool MDNS::isThrottled(IPAddress ip) {
+  unsigned long now = millis();
+  std::vector<Source>::iterator oldest = sources.end();
+
+  for (std::vector<Source>::iterator source = sources.begin(); source != sources.end(); ++source) {
+    if (source->ip == ip) {
+      if (now - source->time >= SOURCE_QUERY_WINDOW) {
+        source->time = now;
+        source->queries = 0;
+      }
 
-    PTRRecord * ptrRecord = new PTRRecord();
-    SRVRecord * srvRecord = new SRVRecord();
-    txtRecord = new TXTRecord();
-    InstanceNSECRecord * instanceNSECRecord = new InstanceNSECRecord();
+      if (source->queries >= SOURCE_MAX_QUERIES) {
+        return true;
+      }
 
-    records.push_back(ptrRecord);
-    records.push_back(srvRecord);
-    records.push_back(txtRecord);
-    records.push_back(instanceNSECRecord);
+      source->queries++;
+      return false;
+    }
 
-    String serviceString = "_" + service + "._" + protocol;
+    if (oldest == sources.end() || (long) (source->time - oldest->time) < 0) {
+      oldest = source;
+    }
+  }
 
-    Label * protocolLabel = new Label("_" + protocol, LOCAL);
+  Source source = { ip, now, 1 };
 
-    if (labels[serviceString] == NULL) {
-      labels[serviceString] = new ServiceLabel(aRecord, "_" + service, protocolLabel);
+  if (sources.size() < SOURCE_TABLE_SIZE) {
+    sources.push_back(source);
+  } else {
+    *oldest = source;
+  }
+
+  return false;
+}
+
+bool MDNS::isRateLimited(std::vector<Record *> & records) {
+  unsigned long now = millis();
+
+  for (std::vector<Record *>::const_iterator i = records.begin(); i != records.end(); ++i) {
+    if ((*i)->isRateLimited(now)) {
+      return true;
     }
+  }
 
-    ((ServiceLabel *) labels[serviceString])->addInstance(ptrRecord, srvRecord, txtRecord);
+  return false;
+}
+
+void MDNS::setMulticast(std::vector<Record *> & records) {
+  unsigned long now = millis();
 
-    String instanceString = instance + "._" + service + "._" + protocol;
+  for (std::vector<Record *>::const_iterator i = records.begin(); i != records.end(); ++i) {
+    (*i)->setMulticast(now);
+  }
+}
 
-    labels[instanceString] = new InstanceLabel(srvRecord, txtRecord, instanceNSECRecord, aRecord, instance, labels[serviceString], true);
+// Legacy replies are a single packet that echoes the question section, which
+// is still in place at the start of the buffer, so the answers follow it.
+// Records multicast less than MULTICAST_INTERVAL ago are left out of multicast
+// responses, unless they answer a probe.
+void MDNS::writeResponses(CachedResponse * cache, bool unicast) {
+  uint16_t answerCount = 0;
+  uint16_t additionalCount = 0;
+  bool truncate = unicast && legacy;
+  bool truncated = false;
+  uint32_t maxTTL = truncate ? LEGACY_TTL : TTL_MAX;
+  bool multicast = cache == NULL && !unicast;
+  unsigned long now = millis();
+
+  STATS_START(buildStart);
+
+  buffer->clear();
+  buffer->setOffset(truncate ? packet->getOffset(ANSWER_SECTION) : HEADER_SIZE);
+
+  for (int32_t n = records.nextAnswer(0, unicast); !truncated && n >= 0; n = records.nextAnswer(n + 1, unicast)) {
+    Record * record = records[n];
+
+    if (isProbing(record)) {
+      continue;
+    }
 
-    for (std::vector<String>::const_iterator i = subServices.begin(); i != subServices.end(); ++i) {
-      String subServiceString = "_" + *i + "._sub." + serviceString;
+    if (multicast && !pendingProbe && record->isRateLimited(now)) {
+      limits.suppressedRecords++;
+    } else if (writeRecord(record, maxTTL, !truncate)) {
+      answerCount++;
 
-      if (labels[subServiceString] == NULL) {
-        labels[subServiceString] = new ServiceLabel(aRecord, "_" + *i, new Label("_sub", labels[serviceString]));
+      if (cache != NULL) {
+        cache->records.push_back(record);
+      } else if (multicast) {
+        record->setMulticast(now);
       }
+    } else if (truncate) {
+      truncated = true;
+    } else if (answerCount > 0) {
+      writePacket(answerCount, 0, QR_FLAG | AA_FLAG, cache, unicast);
 
-      PTRRecord * subPTRRecord = new PTRRecord();
+      answerCount = writeRecord(record, maxTTL, !truncate)? 1 : 0;
 
-      subPTRRecord->setLabel(labels[subServiceString]);
-      subPTRRecord->setInstanceLabel(labels[instanceString]);
+      if (cache != NULL && answerCount > 0) {
+        cache->records.push_back(record);
+      } else if (multicast && answerCount > 0) {
+        record->setMulticast(now);
+      }
+    }
+  }
+
+  bool full = truncated;
 
-      records.push_back(subPTRRecord);
+  for (int32_t n = records.nextAdditional(0, unicast); !full && n >= 0; n = records.nextAdditional(n + 1, unicast)) {
+    Record * record = records[n];
+
+    if (isProbing(record)) {
+      continue;
+    }
+
+    if (multicast && !pendingProbe && record->isRateLimited(now)) {
+      limits.suppressedRecords++;
+    } else if (writeRecord(record, maxTTL, !truncate)) {
+      additionalCount++;
 
-      ((ServiceLabel *) labels[subServiceString])->addInstance(subPTRRecord, srvRecord, txtRecord);
+      if (cache != NULL) {
+        cache->records.push_back(record);
+      } else if (multicast) {
+        record->setMulticast(now);
+      }
+    } else {
+      full = true;
     }
+  }
+
+  if (answerCount > 0 || truncated) {
+    writePacket(answerCount, additionalCount, QR_FLAG | AA_FLAG | (truncated? TC_FLAG : 0), cache, unicast);
+  }
+
+  STATS_COUNT(truncations, full);
 
-    ptrRecord->setLabel(labels[serviceString]);
-    ptrRecord->setInstanceLabel(labels[instanceString]);
-    srvRecord->setLabel(labels[instanceString]);
-    srvRecord->setPort(port);
-    srvRecord->setHostLabel(labels[HOSTNAME]);
-    txtRecord->setLabel(labels[instanceString]);
-    instanceNSECRecord->setLabel(labels[instanceString]);
+  buffer->clear();
+
+  if (unicast) {
+    records.resetUnicast();
   } else {
-    status = success? "Invalid name" : status;
-    success = false;
+    records.reset();
   }
 
-  return success;
+  STATS_SAMPLE(buildMicros, buildStart);
 }
 
-void MDNS::addTXTEntry(String key, String value) {
-  txtRecord->addEntry(key, value);
-}
+// While probing, records owned by or pointing at a name that is not verified
+// yet are held back, and all of them while the host name is, since every
+// record leads to it. Everything else is still answered, and no response is
+// cached until probing is over.
+bool MDNS::isProbing(Record * record) {
+  if (state != STATE_PROBING) {
+    return false;
+  }
 
-bool MDNS::begin() {
-  // Wait for WiFi to connect
-  while (!WiFi.ready()) {
+  Label * target = record->getType() == PTR_TYPE ? ((PTRRecord *) record)->getInstanceLabel() : NULL;
+
+  for (std::vector<Probe>::const_iterator probe = probes.begin(); probe != probes.end(); ++probe) {
+    if (!probe->verified && (probe->host || probe->label == record->getLabel() || probe->label == target)) {
+      return true;
+    }
   }
 
-  udp->begin(MDNS_PORT);
-  udp->joinMulticast(IPAddress(224, 0, 0, 251));
+  return false;
+}
+
+bool MDNS::writeRecord(Record * record, uint32_t maxTTL, bool cacheFlush) {
+  uint16_t offset = buffer->getOffset();
 
-  // TODO: Probing + announcing
+  record->write(buffer, maxTTL, cacheFlush);
 
-  return true;
+  if (buffer->overflow()) {
+    buffer->rewind(offset);
+  }
+
+  return buffer->getOffset() > offset;
 }
 
-bool MDNS::processQueries() {
-  uint16_t n = udp->parsePacket();
+void MDNS::writePacket(uint16_t answerCount, uint16_t additionalCount, uint16_t flags, CachedResponse * cache, bool unicast) {
+  uint16_t size = buffer->getOffset();
+  bool legacy = unicast && this->legacy;
+
+  buffer->setOffset(0);
+  buffer->writeUInt16(legacy ? packet->getId() : 0x0);
+  buffer->writeUInt16(flags);
+  buffer->writeUInt16(legacy ? packet->getCount(QUESTION_SECTION) : 0x0);
+  buffer->writeUInt16(answerCount);
+  buffer->writeUInt16(0x0);
+  buffer->writeUInt16(additionalCount);
+  buffer->setOffset(size);
+
+  if (cache != NULL) {
+    buffer->copy(cache->data);
+    cache->sizes.push_back(size);
+  } else {
+    STATS_START(sendStart);
+
+    if (unicast) {
+      udp->beginPacket(udp->remoteIP(), udp->remotePort());
+    } else {
+      udp->beginPacket(IPAddress(224, 0, 0, 251), MDNS_PORT);
+    }
 
-  if (n > 0) {
-    buffer->read(udp);
+    buffer->write(udp);
 
-    udp->flush();
+    udp->endPacket();
 
-    getResponses();
+    STATS_SEND(sendStart);
+    STATS_COUNT(responsesSent, 1);
+    STATS_COUNT(bytesSent, size);
+  }
 
-    buffer->clear();
+  buffer->clear();
+  buffer->setOffset(HEADER_SIZE);
+}
 
-    writeResponses();
+// Probes carry as many of our unique names as fit in one packet, each asked
+// with type ANY and followed by the records we intend to claim in the
+// authority section. The first round asks for unicast replies.
+void MDNS::writeProbes(bool unicast) {
+  std::vector<Label *> names;
 
-    if (buffer->available() > 0) {
-      udp->beginPacket(IPAddress(224, 0, 0, 251), MDNS_PORT);
+  for (std::vector<Probe>::const_iterator probe = probes.begin(); probe != probes.end(); ++probe) {
+    if (!probe->verified) {
+      names.push_back(probe->label);
+    }
+  }
 
-      buffer->write(udp);
+  size_t first = 0;
 
-      udp->endPacket();
+  while (first < names.size()) {
+    size_t count = 1;
+
+    while (first + count < names.size() && writeProbe(names, first, count + 1, unicast)) {
+      count++;
     }
+
+    writeProbe(names, first, count, unicast);
+
+    udp->beginPacket(IPAddress(224, 0, 0, 251), MDNS_PORT);
+
+    buffer->write(udp);
+
+    udp->endPacket();
+
+    first += count;
   }
 
-  return n > 0;
+  buffer->clear();
 }
 
-void MDNS::getResponses() {
-  QueryHeader header = readHeader(buffer);
-
-  if ((header.flags & 0x8000) == 0 && header.qdcount > 0) {
-    uint8_t count = 0;
+bool MDNS::writeProbe(std::vector<Label *> & names, size_t first, size_t count, bool unicast) {
+  uint16_t authorityCount = 0;
+  bool fits = true;
 
-    while (count++ < header.qdcount && buffer->available() > 0) {
-      Label * label = matcher->match(labels, buffer);
+  buffer->clear();
+  buffer->setOffset(HEADER_SIZE);
 
-      if (buffer->available() >= 4) {
-        uint16_t type = buffer->readUInt16();
-        uint16_t cls = buffer->readUInt16();
+  for (size_t n = first; n < first + count; n++) {
+    names[n]->write(buffer);
+    buffer->writeUInt16(ANY_TYPE);
+    buffer->writeUInt16(unicast ? IN_CLASS | QU_FLAG : IN_CLASS);
+  }
 
-        if (label != NULL) {
+  fits = !buffer->overflow();
 
-          label->matched(type, cls);
+  for (size_t n = first; fits && n < first + count; n++) {
+    for (std::vector<Record *>::const_iterator i = records.begin(); i != records.end(); ++i) {
+      if ((*i)->getLabel() == names[n] && (*i)->getType() != NSEC_TYPE) {
+        if (writeRecord(*i, TTL_MAX, false)) {
+          authorityCount++;
+        } else {
+          fits = false;
         }
-      } else {
-        status = "Buffer underflow at index " + buffer->getOffset();
       }
     }
   }
-}
 
-MDNS::QueryHeader MDNS::readHeader(Buffer * buffer) {
-  QueryHeader header;
+  uint16_t size = buffer->getOffset();
 
-  if (buffer->available() >= 12) {
-    header.id = buffer->readUInt16();
-    header.flags = buffer->readUInt16();
-    header.qdcount = buffer->readUInt16();
-    header.ancount = buffer->readUInt16();
-    header.nscount = buffer->readUInt16();
-    header.arcount = buffer->readUInt16();
-  }
+  buffer->setOffset(0);
+  buffer->writeUInt16(0x0);
+  buffer->writeUInt16(0x0);
+  buffer->writeUInt16(count);
+  buffer->writeUInt16(0x0);
+  buffer->writeUInt16(authorityCount);
+  buffer->writeUInt16(0x0);
+  buffer->setOffset(size);
 
-  return header;
+  return fits;
 }
 
-void MDNS::writeResponses() {
+// Announcements and goodbyes are unsolicited multicast responses carrying the
+// given records as answers, split across as many packets as needed. Unique
+// records have the cache-flush bit set.
+void MDNS::writeRecords(std::vector<Record *> & records, uint32_t maxTTL) {
+  uint16_t answerCount = 0;
+
+  buffer->clear();
+  buffer->setOffset(HEADER_SIZE);
 
-  uint8_t answerCount = 0;
-  uint8_t additionalCount = 0;
+  setMulticast(records);
 
   for (std::vector<Record *>::const_iterator i = records.begin(); i != records.end(); ++i) {
-    if ((*i)->isAnswerRecord()) {
+    if (writeRecord(*i, maxTTL)) {
       answerCount++;
-    }
-    if ((*i)->isAdditionalRecord()) {
-      additionalCount++;
+    } else if (answerCount > 0) {
+      writePacket(answerCount, 0, QR_FLAG | AA_FLAG, NULL, false);
+
+      answerCount = writeRecord(*i, maxTTL)? 1 : 0;
     }
   }
 
   if (answerCount > 0) {
-    buffer->writeUInt16(0x0);
-    buffer->writeUInt16(0x8400);
-    buffer->writeUInt16(0x0);
-    buffer->writeUInt16(answerCount);
-    buffer->writeUInt16(0x0);
-    buffer->writeUInt16(additionalCount);
+    writePacket(answerCount, 0, QR_FLAG | AA_FLAG, NULL, false);
+  }
 
-    for (std::vector<Record *>::const_iterator i = records.begin(); i != records.end(); ++i) {
-      if ((*i)->isAnswerRecord()) {
-        (*i)->write(buffer);
-      }
+  buffer->clear();
+}
+
+std::map<MDNS::ResponseKey, MDNS::CachedResponse>::iterator MDNS::cacheResponse(ResponseKey key) {
+  if (responses.size() >= RESPONSE_CACHE_SIZE) {
+    responses.erase(responses.begin());
+  }
+
+  CachedResponse & response = responses[key];
+
+  key.first->matched(key.second, IN_CLASS);
+
+  response.shared = scheduleRecords();
+
+  writeResponses(&response);
+
+  return responses.find(key);
+}
+
+void MDNS::writePendingResponse() {
+  if (pendingKeyed && state == STATE_PROBING) {
+    pendingKey.first->matched(pendingKey.second, IN_CLASS);
+
+    scheduleRecords();
+
+    writeResponses();
+  } else if (pendingKeyed) {
+    std::map<ResponseKey, CachedResponse>::iterator i = responses.find(pendingKey);
+
+    if (i == responses.end()) {
+      i = cacheResponse(pendingKey);
     }
 
-    for (std::vector<Record *>::const_iterator i = records.begin(); i != records.end(); ++i) {
-      if ((*i)->isAdditionalRecord()) {
-        (*i)->write(buffer);
-      }
+    if (!pendingProbe && isRateLimited(i->second.records)) {
+      pendingKey.first->matched(pendingKey.second, IN_CLASS);
+
+      scheduleRecords();
+
+      writeResponses();
+    } else {
+      sendResponse(i->second, IPAddress(224, 0, 0, 251), MDNS_PORT);
+
+      setMulticast(i->second.records);
     }
+  } else {
+    writeResponses();
   }
 
-  for (std::map<String, Label *>::const_iterator i = labels.begin(); i != labels.end(); ++i) {
-    i->second->reset();
+  pending = false;
+  pendingKeyed = false;
+  pendingProbe = false;
+}
+
+// Unicast replies go out immediately and leave any pending multicast response
+// untouched. A keyed QU question can still be answered from the cache, since
+// only the destination differs.
+void MDNS::writeUnicastResponse() {
+  if (keyed) {
+    std::map<ResponseKey, CachedResponse>::iterator i = responses.find(responseKey);
+
+    if (i == responses.end() && (!pending || pendingKeyed)) {
+      i = cacheResponse(responseKey);
+    }
+
+    if (i != responses.end()) {
+      sendResponse(i->second, udp->remoteIP(), udp->remotePort());
+      return;
+    }
+
+    responseKey.first->matched(responseKey.second, IN_CLASS);
   }
 
-  for (std::vector<Record *>::const_iterator i = records.begin(); i != records.end(); ++i) {
-    (*i)->reset();
+  writeResponses(NULL, true);
+}
+
+void MDNS::sendResponse(CachedResponse & response, IPAddress ip, uint16_t port) {
+  const uint8_t * data = response.data.data();
+
+  for (std::vector<uint16_t>::const_iterator size = response.sizes.begin(); size != response.sizes.end(); ++size) {
+    STATS_START(sendStart);
+
+    udp->beginPacket(ip, port);
+
+    udp->write(data, *size);
+
+    udp->endPacket();
+
+    STATS_SEND(sendStart);
+    STATS_COUNT(responsesSent, 1);
+    STATS_COUNT(bytesSent, *size);
+
+    data += *size;
+  }
+}
+
+bool MDNS::setBufferSize(uint16_t size) {
+#if PLATFORM_THREADING
+  if (isQueued() && size >= MIN_BUFFER_SIZE && size <= MAX_BUFFER_SIZE) {
+    Change change = { CHANGE_SET_BUFFER_SIZE, "", "", "", size };
+
+    return queueChange(change);
+  } else if (isQueued()) {
+    status = "Invalid buffer size";
+    return false;
+  }
+#endif
+
+  bool success = size >= MIN_BUFFER_SIZE && size <= MAX_BUFFER_SIZE && buffer->setSize(size);
+
+  if (success) {
+    responses.clear();
+  } else {
+    status = "Invalid buffer size";
   }
+
+  return success;
 }
 
 bool MDNS::isAlphaDigitHyphen(String string) {
@@ -743,6 +4089,31 @@ bool MDNS::isAlphaDigitHyphen(String string) {
   return result;
 }
 
+// The same checks for a label in wire format, which must not be empty. The
+// leading underscore of a protocol or service label is required and skipped.
+bool MDNS::isAlphaDigitHyphen(const uint8_t * label, bool underscore) {
+  uint8_t first = underscore ? 2 : 1;
+  bool result = label != NULL && label[0] >= first && label[0] <= MAX_LABEL_SIZE && (!underscore || label[1] == '_');
+
+  for (uint8_t idx = first; result && idx <= label[0]; idx++) {
+    uint8_t c = label[idx];
+
+    result = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-';
+  }
+
+  return result;
+}
+
+bool MDNS::isNetUnicode(const uint8_t * label) {
+  bool result = label != NULL && label[0] > 0 && label[0] <= MAX_LABEL_SIZE;
+
+  for (uint8_t idx = 1; result && idx <= label[0]; idx++) {
+    result = label[idx] >= 0x1f && label[idx] != 0x7f;
+  }
+
+  return result;
+}
+
 bool MDNS::isNetUnicode(String string) {
   bool result = true;
 
@@ -1,18 +1,35 @@
 #include "Particle.h"
+#include <algorithm>
+#include <atomic>
 #include <map>
 #include <vector>
 
+#if PLATFORM_THREADING
+#include <mutex>
+#endif
+
 #ifndef _INCL_BUFFER
 #define _INCL_BUFFER
 
 #define INVALID_MARK_OFFSET 0xffff
 
+class Label;
+
 class Buffer {
 public:
   Buffer(uint16_t size);
+  ~Buffer();
+
+  bool setSize(uint16_t size);
+
+  uint16_t getSize();
 
   uint16_t available();
 
+  bool overflow();
+
+  void rewind(uint16_t offset);
+
   void mark();
   void reset();
   void setOffset(uint16_t offset);
@@ -22,31 +39,171 @@ public:
 
   uint8_t readUInt8();
   uint16_t readUInt16();
+  uint32_t readUInt32();
 
   void write(UDP * udp);
 
+  void copy(std::vector<uint8_t> & data);
+
   void writeUInt8(uint8_t value);
   void writeUInt16(uint16_t value);
   void writeUInt32(uint32_t value);
+  void writeBytes(const uint8_t * data, uint16_t length);
+
+  int16_t findName(Label * label);
+  void addName(Label * label, uint16_t offset);
 
   void clear();
 
 private:
 
+  // Where each name written since the buffer was cleared starts, for
+  // compression. The table keeps its capacity across packets, so it only
+  // grows until it fits the most names a packet of this size has held.
+  struct Name {
+    Label * label;
+    uint16_t offset;
+  };
+
   uint8_t * data;
   uint16_t size;
+  std::vector<Name> names;
 
   uint16_t limit = 0;
   uint16_t offset = 0;
   uint16_t markOffset = INVALID_MARK_OFFSET;
+  bool overflowed = false;
+};
+
+#endif
+
+#ifndef _INCL_ARENA
+#define _INCL_ARENA
+
+#define ARENA_SIZE 2048
+#define ARENA_ALIGNMENT sizeof(void *)
+#define ARENA_MAX_BLOCK_SIZE (UINT16_MAX & ~(ARENA_ALIGNMENT - 1))
+
+class Arena {
+public:
+  Arena(uint16_t size);
+
+  void * allocate(size_t size);
+
+  void release(void * p);
+
+  template <typename T> void destroy(T * object) {
+    if (object != NULL) {
+      object->~T();
+      release(object);
+    }
+  }
+
+  uint16_t getSize();
+
+  uint16_t getUsed();
+
+  uint32_t getHeapUsed();
+
+private:
+  struct Block {
+    uint16_t size;
+    bool free;
+    bool heap;
+  };
+
+  uint8_t * data;
+  uint16_t size;
+  uint16_t top = 0;
+  uint16_t used = 0;
+  uint32_t heapUsed = 0;
+
+  static size_t align(size_t size);
+};
+
+void * operator new(size_t size, Arena * arena) noexcept;
+void operator delete(void * p, Arena * arena);
+
+#endif
+
+#ifndef _INCL_WIRE
+#define _INCL_WIRE
+
+// Names and TXT data in wire format, built by the compiler. wireLabel("_http")
+// is a label as it appears in a packet, its length followed by its
+// characters, and wireTXT("path=/", "v=1") is the data of a TXT record with
+// those entries. Declared constexpr at namespace scope they end up in flash,
+// and a StaticConfiguration refers to them without copying.
+
+template <size_t N> struct Wire {
+  uint8_t data[N];
+};
+
+template <size_t... I> struct WireIndices {
+};
+
+template <size_t N, size_t... I> struct WireSequence : WireSequence<N - 1, N - 1, I...> {
+};
+
+template <size_t... I> struct WireSequence<0, I...> {
+  typedef WireIndices<I...> type;
+};
+
+template <size_t... N> struct WireSize;
+
+template <> struct WireSize<> {
+  static const size_t value = 0;
+};
+
+template <size_t N, size_t... Rest> struct WireSize<N, Rest...> {
+  static const size_t value = N + WireSize<Rest...>::value;
+};
+
+// Whether every string fits behind a length byte no larger than Max.
+template <size_t Max, size_t... N> struct WireFits;
+
+template <size_t Max> struct WireFits<Max> {
+  static const bool value = true;
+};
+
+template <size_t Max, size_t N, size_t... Rest> struct WireFits<Max, N, Rest...> {
+  static const bool value = N - 1 <= Max && WireFits<Max, Rest...>::value;
 };
 
+// A string of N characters, counting the terminator, takes N bytes: the
+// terminator is dropped and the length goes in front.
+template <size_t N> constexpr uint8_t wireByte(size_t i, const char (&string)[N]) {
+  return i == 0 ? N - 1 : string[i - 1];
+}
+
+template <size_t N, typename... Strings> constexpr uint8_t wireByte(size_t i, const char (&string)[N], const Strings & ... strings) {
+  return i < N ? wireByte(i, string) : wireByte(i - N, strings...);
+}
+
+template <size_t... I, typename... Strings> constexpr Wire<sizeof...(I)> wireBytes(WireIndices<I...>, const Strings & ... strings) {
+  return Wire<sizeof...(I)> { { wireByte(I, strings...)... } };
+}
+
+template <size_t... N> constexpr Wire<WireSize<N...>::value> wireTXT(const char (&... strings)[N]) {
+  static_assert(WireFits<255, N...>::value, "TXT strings are at most 255 characters");
+
+  return wireBytes(typename WireSequence<WireSize<N...>::value>::type(), strings...);
+}
+
+template <size_t N> constexpr Wire<N> wireLabel(const char (&string)[N]) {
+  static_assert(N - 1 <= 63, "labels are at most 63 characters");
+
+  return wireTXT(string);
+}
+
 #endif
 
 #ifndef _INCL_RECORD
 #define _INCL_RECORD
 
 #define IN_CLASS 1
+#define QU_FLAG 0x8000
+#define CACHE_FLUSH_FLAG 0x8000
 
 #define A_TYPE 0x01
 #define PTR_TYPE 0x0c
@@ -59,95 +216,160 @@ private:
 
 #define TTL_2MIN 120
 #define TTL_75MIN 4500
+#define TTL_MAX 0xffffffffUL
+
+#define MAX_TXT_ENTRY_SIZE 255
 
 #define IP_SIZE 4
+#define IPV6_SIZE 16
+
+#define NSEC_BITMAP_SIZE 8
+
+#define MULTICAST_INTERVAL 1000
+
+#define ANSWER_RECORDS 0
+#define ADDITIONAL_RECORDS 1
+#define KNOWN_RECORDS 2
+#define SCHEDULED_ANSWER_RECORDS 3
+#define SCHEDULED_ADDITIONAL_RECORDS 4
+#define DUPLICATE_RECORDS 5
+#define SHARED_RECORDS 6
+#define RECORD_SETS 7
+
+#define RECORD_SET_BITS 32
 
 class Label;
+class RecordTable;
 
 class Record {
 
 public:
 
+  virtual ~Record();
+
   void setLabel(Label * label);
 
   void setAnswerRecord();
 
-  bool isAnswerRecord();
-
   void setAdditionalRecord();
 
-  bool isAdditionalRecord();
-
   void setKnownRecord();
 
-  void write(Buffer * buffer);
+  void setDuplicateRecord();
 
-  void reset();
+  bool isShared();
 
-protected:
+  void setMulticast(unsigned long time);
 
-  Record(uint16_t type, uint32_t ttl);
+  bool isRateLimited(unsigned long time);
+
+  bool matches(Label * label, uint16_t type, Buffer * buffer, uint16_t length);
+
+  uint32_t getTTL();
+
+  uint16_t getType();
 
   Label * getLabel();
 
+  void write(Buffer * buffer, uint32_t maxTTL = TTL_MAX, bool cacheFlush = true);
+
+  void writeData(Buffer * buffer);
+
+protected:
+
+  Record(uint16_t type, uint32_t ttl, bool shared = false);
+
   virtual void writeSpecific(Buffer * buffer) = 0;
 
+  virtual bool matchesSpecific(Buffer * buffer, uint16_t length);
+
 private:
 
-  Label * label;
+  friend class RecordTable;
+
+  Label * label = NULL;
   uint16_t type;
   uint32_t ttl;
-  bool answerRecord = false;
-  bool additionalRecord = false;
-  bool knownRecord = false;
+  bool shared;
+  RecordTable * table = NULL;
+  uint16_t index = 0;
+  bool multicast = false;
+  unsigned long multicastTime = 0;
 };
 
-class ARecord : public Record {
+class AddressRecord : public Record {
 
 public:
 
-  ARecord();
+  void setAddress(const uint8_t * address);
+
+  bool hasAddress(uint16_t type, const uint8_t * address);
 
   virtual void writeSpecific(Buffer * buffer);
-};
 
-class NSECRecord : public Record {
+  virtual bool matchesSpecific(Buffer * buffer, uint16_t length);
 
-public:
+protected:
 
-  NSECRecord();
+  AddressRecord(uint16_t type, uint8_t size);
 
-  virtual void writeSpecific(Buffer * buffer) = 0;
+private:
+
+  uint8_t address[IPV6_SIZE];
+  uint8_t size;
 };
 
-class HostNSECRecord : public NSECRecord {
+class ARecord : public AddressRecord {
 
 public:
 
-  HostNSECRecord();
+  ARecord();
+};
 
-  virtual void writeSpecific(Buffer * buffer);
+class AAAARecord : public AddressRecord {
+
+public:
+
+  AAAARecord();
 };
 
-class InstanceNSECRecord : public NSECRecord {
+class NSECRecord : public Record {
 
 public:
 
-  InstanceNSECRecord();
+  NSECRecord();
+
+  void addType(uint16_t type);
+
+  void clearTypes();
 
   virtual void writeSpecific(Buffer * buffer);
+
+protected:
+
+  virtual bool matchesSpecific(Buffer * buffer, uint16_t length);
+
+private:
+
+  uint8_t bitmap[NSEC_BITMAP_SIZE] = { 0 };
+
+  uint8_t getBitmapSize();
 };
 
 class PTRRecord : public Record {
 
 public:
 
-  PTRRecord();
+  PTRRecord(bool shared = true);
 
   virtual void writeSpecific(Buffer * buffer);
 
+  virtual bool matchesSpecific(Buffer * buffer, uint16_t length);
+
   void setInstanceLabel(Label * label);
 
+  Label * getInstanceLabel();
+
 private:
 
   Label * instanceLabel;
@@ -162,6 +384,8 @@ public:
 
   virtual void writeSpecific(Buffer * buffer);
 
+  virtual bool matchesSpecific(Buffer * buffer, uint16_t length);
+
   void setHostLabel(Label * label);
 
   void setPort(uint16_t port);
@@ -176,15 +400,88 @@ class TXTRecord : public Record {
 
 public:
 
-  TXTRecord();
+  TXTRecord(Arena * arena);
+
+  virtual ~TXTRecord();
 
   virtual void writeSpecific(Buffer * buffer);
 
+  virtual bool matchesSpecific(Buffer * buffer, uint16_t length);
+
   void addEntry(String key, String value = NULL);
 
+  void setEntries(std::vector<String> entries);
+
+  void setData(const uint8_t * data, uint16_t size);
+
 private:
 
-  std::vector<String> data;
+  Arena * arena;
+  const uint8_t * data = NULL;
+  uint16_t size = 0;
+  bool owned = true;
+
+  void release();
+
+  void append(String entry);
+  static uint16_t encode(uint8_t * data, String entry);
+};
+
+// The records we own, in the order they are written, with the name and type
+// of each kept alongside so lookups do not touch the records themselves. What
+// a packet asks for is kept as bit sets over the table: labels mark records
+// as answers or additional records, known answers are masked out when they
+// are scheduled, and responses visit only the records that are set. There
+// are no precomputed sets per label and type; a matched label walks its own
+// records, and scheduling, writing and resetting a response still cost one
+// word per 32 records in the table.
+class RecordTable {
+
+public:
+
+  typedef std::vector<Record *>::const_iterator const_iterator;
+
+  const_iterator begin() const;
+
+  const_iterator end() const;
+
+  size_t size() const;
+
+  Record * operator[](size_t index) const;
+
+  void reserve(size_t size);
+
+  void push_back(Record * record);
+
+  void erase(Record * record);
+
+  int32_t find(Label * label, uint16_t type, int32_t index = 0) const;
+
+  void setLabel(uint16_t index, Label * label);
+
+  void set(uint8_t set, uint16_t index);
+
+  bool schedule();
+
+  int32_t nextAnswer(int32_t index, bool unicast) const;
+
+  int32_t nextAdditional(int32_t index, bool unicast) const;
+
+  void reset();
+
+  void resetUnicast();
+
+private:
+
+  std::vector<Record *> records;
+  std::vector<Label *> labels;
+  std::vector<uint16_t> types;
+  std::vector<uint32_t> sets[RECORD_SETS];
+
+  bool test(uint8_t set, size_t index) const;
+  void assign(uint8_t set, size_t index, bool value);
+  uint32_t select(size_t word, bool additional, bool unicast) const;
+  int32_t next(int32_t index, bool additional, bool unicast) const;
 };
 
 #endif
@@ -193,6 +490,7 @@ private:
 #define _INCL_LABEL
 
 #define DOT '.'
+#define BACKSLASH '\\'
 
 #define END_OF_NAME 0x0
 #define LABEL_POINTER 0xc0
@@ -202,28 +500,68 @@ private:
 #define UNKNOWN_NAME -1
 #define BUFFER_UNDERFLOW -2
 
-class Label {
-private:
+#define MAX_NAME_SIZE 255
+#define MAX_POINTER_DEPTH 8
 
-  class Iterator;
+#define FNV_OFFSET_BASIS 2166136261UL
+#define FNV_PRIME 16777619UL
 
+class Label {
 public:
   class Matcher {
   public:
-    Label * match(std::map<String, Label *> labels, Buffer * buffer);
+    void build(std::vector<Label *> & labels);
+
+    void add(Label * label);
+
+    void remove(Label * label);
+
+    Label * match(Buffer * buffer);
+
+  private:
+    struct Entry {
+      uint32_t hash;
+      Label * label;
+
+      bool operator<(const Entry & entry) const;
+    };
+
+    std::vector<Entry> entries;
+
+    static Entry entry(Label * label);
+
+    static uint32_t hash(uint32_t hash, uint8_t c);
   };
 
-  Label(String name, Label * nextLabel = NULL, bool caseSensitive = false);
+  Label(Arena * arena, String name, Label * nextLabel = NULL, bool caseSensitive = false);
+
+  Label(Arena * arena, const uint8_t * data, Label * nextLabel = NULL, bool caseSensitive = false);
+
+  virtual ~Label();
+
+  bool equals(String name);
+
+  bool equals(const uint8_t * data);
+
+  bool equals(Label * label);
+
+  String getName();
+
+  Label * getNextLabel();
+
+  void setName(String name);
+
+  static uint16_t read(Buffer * buffer, uint8_t * name);
 
   uint8_t getSize();
 
-  uint8_t getWriteSize();
+  uint8_t getWriteSize(Buffer * buffer);
 
   void write(Buffer * buffer);
 
-  virtual void matched(uint16_t type, uint16_t cls);
+  bool matches(Buffer * buffer);
 
-  void reset();
+  virtual void matched(uint16_t type, uint16_t cls);
 
 private:
   class Reader {
@@ -235,137 +573,607 @@ private:
     uint8_t next();
 
     bool endOfName();
+
+    uint16_t read(uint8_t * name);
   private:
     Buffer * buffer;
     uint8_t c = 1;
+    uint16_t start;
+    uint8_t depth = 0;
+    bool valid = true;
   };
 
-  class Iterator {
-  public:
-    Iterator(Label * label);
-
-    bool match(uint8_t c);
-
-    bool matched();
-
-    Label * getStartLabel();
-
-  private:
-    Label * startLabel;
-    Label * label;
-    uint8_t size;
-    uint8_t offset = 0;
-    bool matches = true;
+  bool equals(uint8_t * name, uint16_t length);
 
-    bool equalsIgnoreCase(uint8_t c);
-  };
+  void setData(String name);
 
-  uint8_t * EMPTY_DATA = { END_OF_NAME };
-  uint8_t * data;
+  Arena * arena;
+  const uint8_t * data;
+  bool owned;
   bool caseSensitive;
   Label * nextLabel;
-  int16_t writeOffset = INVALID_OFFSET;
 };
 
 class HostLabel : public Label {
 
 public:
 
-  HostLabel(Record * aRecord, Record * nsecRecord, String name, Label * nextLabel = NULL, bool caseSensitive = false);
+  HostLabel(Arena * arena, NSECRecord * nsecRecord, String name, Label * nextLabel = NULL, bool caseSensitive = false);
+
+  HostLabel(Arena * arena, NSECRecord * nsecRecord, const uint8_t * data, Label * nextLabel = NULL, bool caseSensitive = false);
+
+  void setAddressRecords(std::vector<Record *> & records);
+
+  std::vector<Record *> & getAddressRecords();
+
+  void setAdditionalRecords();
 
   virtual void matched(uint16_t type, uint16_t cls);
 
 private:
-  Record * aRecord;
-  Record * nsecRecord;
+  std::vector<Record *> addressRecords;
+  NSECRecord * nsecRecord;
 };
 
 class ServiceLabel : public Label {
 
 public:
 
-  ServiceLabel(Record * aRecord, String name, Label * nextLabel = NULL, bool caseSensitive = false);
+  ServiceLabel(Arena * arena, HostLabel * hostLabel, String name, Label * nextLabel = NULL, bool caseSensitive = false);
+
+  ServiceLabel(Arena * arena, HostLabel * hostLabel, const uint8_t * data, Label * nextLabel = NULL, bool caseSensitive = false);
 
   void addInstance(Record * ptrRecord, Record * srvRecord, Record * txtRecord);
 
+  Record * removeInstance(Record * srvRecord);
+
+  bool hasInstances();
+
   virtual void matched(uint16_t type, uint16_t cls);
 
 private:
-  Record * aRecord;
-  std::vector<Record *> ptrRecords;
-  std::vector<Record *> srvRecords;
-  std::vector<Record *> txtRecords;
+  struct Instance {
+    Record * ptrRecord;
+    Record * srvRecord;
+    Record * txtRecord;
+  };
+
+  HostLabel * hostLabel;
+  std::vector<Instance> instances;
 };
 
 class InstanceLabel : public Label {
 
 public:
 
-  InstanceLabel(Record * srvRecord, Record * txtRecord, Record * nsecRecord, Record * aRecord, String name, Label * nextLabel = NULL, bool caseSensitive = false);
+  InstanceLabel(Arena * arena, HostLabel * hostLabel, String name, Label * nextLabel = NULL, bool caseSensitive = false);
+
+  InstanceLabel(Arena * arena, HostLabel * hostLabel, const uint8_t * data, Label * nextLabel = NULL, bool caseSensitive = false);
+
+  void setRecords(Record * srvRecord, Record * txtRecord, Record * nsecRecord);
 
   virtual void matched(uint16_t type, uint16_t cls);
 
 private:
-  Record * srvRecord;
-  Record * txtRecord;
-  Record * nsecRecord;
-  Record * aRecord;
+  Record * srvRecord = NULL;
+  Record * txtRecord = NULL;
+  Record * nsecRecord = NULL;
+  HostLabel * hostLabel;
+};
+
+// Names that only hold PTR records pointing elsewhere: the service type
+// enumeration name and reverse address names.
+class MetaLabel : public Label {
+
+public:
+
+  MetaLabel(Arena * arena, String name, Label * nextLabel = NULL, bool caseSensitive = false);
+
+  MetaLabel(Arena * arena, const uint8_t * data, Label * nextLabel = NULL, bool caseSensitive = false);
+
+  void addRecord(Record * record);
+
+  void removeRecord(Record * record);
+
+  virtual void matched(uint16_t type, uint16_t cls);
+
+private:
+  std::vector<Record *> records;
 };
 
 #endif
 
 
+#ifndef _INCL_PACKET
+#define _INCL_PACKET
+
+#define HEADER_SIZE 12
+
+#define QR_FLAG 0x8000
+#define AA_FLAG 0x0400
+#define TC_FLAG 0x0200
+
+#define QUESTION_SECTION 0
+#define ANSWER_SECTION 1
+#define AUTHORITY_SECTION 2
+#define ADDITIONAL_SECTION 3
+#define SECTION_COUNT 4
+
+class Packet {
+public:
+
+  Packet(Buffer * buffer);
+
+  bool read(bool truncated = false);
+
+  uint16_t getId();
+
+  uint16_t getFlags();
+
+  bool isResponse();
+
+  uint16_t getCount(uint8_t section);
+
+  uint16_t getOffset(uint8_t section);
+
+private:
+
+  Buffer * buffer;
+
+  uint16_t id = 0;
+  uint16_t flags = 0;
+  uint16_t counts[SECTION_COUNT];
+  uint16_t offsets[SECTION_COUNT];
+
+  bool readName();
+  bool readEntry(uint8_t section);
+};
+
+#endif
+
 #ifndef _INCL_MDNS
 #define _INCL_MDNS
 
 #define MDNS_PORT 5353
 
 #define BUFFER_SIZE 512
-#define HOSTNAME ""
+#define INTERFACE_MTU 1500
+#define IP_UDP_HEADER_SIZE 28
+#define MAX_BUFFER_SIZE (INTERFACE_MTU - IP_UDP_HEADER_SIZE)
+#define MIN_BUFFER_SIZE 512
+
+#define RESPONSE_CACHE_SIZE 8
+
+#define SHARED_RESPONSE_MIN_DELAY 20
+#define SHARED_RESPONSE_MAX_DELAY 120
+
+#define LEGACY_TTL 10
+
+#define STATE_STOPPED 0
+#define STATE_STARTING 1
+#define STATE_PROBING 2
+#define STATE_ANNOUNCING 3
+#define STATE_RUNNING 4
+
+#define PROBE_COUNT 3
+#define PROBE_INTERVAL 250
+#define PROBE_DEFER_DELAY 1000
+#define ANNOUNCE_COUNT 2
+#define ANNOUNCE_INTERVAL 1000
+
+#define ADDRESS_REFRESH_INTERVAL 10000
+#define START_RETRY_INTERVAL 100
+
+#define QUERY_MIN_DELAY 20
+#define QUERY_MAX_DELAY 120
+#define QUERY_INTERVAL 1000
+#define QUERY_MAX_INTERVAL 3600000UL
+#define QUERY_ATTEMPTS 3
+
+#define QUERY_CACHE_SIZE 32
+#define CACHE_REFRESH_PERCENT 80
+#define CACHE_REFRESH_STEP 5
+#define CACHE_REFRESH_COUNT 4
+#define CACHE_FLUSH_DELAY 1000
+#define CACHE_MAX_TTL 86400
+#define GOODBYE_TTL 1
+
+#define SOURCE_TABLE_SIZE 8
+#define SOURCE_QUERY_WINDOW 1000
+#define SOURCE_MAX_QUERIES 20
+
+// Statistics are on unless built with -DMDNS_STATS=0.
+#ifndef MDNS_STATS
+#define MDNS_STATS 1
+#endif
+
+#define STATS_BUCKETS 12
+
+#define CHANGE_QUEUE_SIZE 8
+#define RESPONDER_INTERVAL 10
+#define RESPONDER_BATCH_SIZE 8
+#define RESPONDER_STACK_SIZE 3072
+
+#define CHANGE_ADD_SERVICE 1
+#define CHANGE_ADD_TXT_ENTRY 2
+#define CHANGE_REMOVE_SERVICE 3
+#define CHANGE_UPDATE_TXT 4
+#define CHANGE_SET_PORT 5
+#define CHANGE_BROWSE 6
+#define CHANGE_RESOLVE 7
+#define CHANGE_SET_HOSTNAME 8
+#define CHANGE_SET_BUFFER_SIZE 9
+#define CHANGE_RESET_STATS 10
+
+#define RESOLVE_RETRY_INTERVAL 1000
+
+typedef void (*BrowseCallback)(String instance, String host, uint16_t port, bool available);
 
 class MDNS {
 public:
 
+  struct Batch {
+    uint16_t processed;
+    uint16_t dropped;
+  };
+
+  struct MemoryUsage {
+    uint16_t arenaSize;
+    uint16_t arenaUsed;
+    uint32_t heapUsed;
+    uint16_t labels;
+    uint16_t records;
+  };
+
+  // A configuration known at build time. Names and TXT data are in wire
+  // format, see wireLabel and wireTXT, and protocol and service labels carry
+  // their leading underscore.
+  struct StaticService {
+    const uint8_t * protocol;
+    const uint8_t * service;
+    uint16_t port;
+    const uint8_t * instance;
+    const uint8_t * const * subServices;
+    uint8_t subServiceCount;
+    const uint8_t * txt;
+    uint16_t txtSize;
+  };
+
+  struct StaticConfiguration {
+    const uint8_t * hostname;
+    const StaticService * services;
+    uint8_t serviceCount;
+  };
+
+  struct RateLimits {
+    uint32_t suppressedRecords;
+    uint32_t throttledQueries;
+  };
+
+#if MDNS_STATS
+  // Bucket n of a histogram counts samples under 2^n microseconds, the last
+  // one everything longer.
+  struct Stats {
+    uint32_t packetsReceived;
+    uint32_t malformedPackets;
+    uint32_t questions;
+    uint32_t matchedQuestions;
+    uint32_t unmatchedQuestions;
+    uint32_t knownAnswers;
+    uint32_t duplicateAnswers;
+    uint32_t responsesSent;
+    uint32_t bytesSent;
+    uint32_t truncations;
+    uint32_t matchMicros[STATS_BUCKETS];
+    uint32_t buildMicros[STATS_BUCKETS];
+    uint32_t sendMicros[STATS_BUCKETS];
+  };
+#endif
+
+  MDNS(uint16_t arenaSize = ARENA_SIZE);
+
+#if PLATFORM_THREADING
+  ~MDNS();
+#endif
+
   bool setHostname(String hostname);
 
   bool addService(String protocol, String service, uint16_t port, String instance, std::vector<String> subServices = std::vector<String>());
 
   void addTXTEntry(String key, String value = NULL);
 
+  bool removeService(String protocol, String service, String instance);
+
+  bool updateTXT(String protocol, String service, String instance, std::vector<String> entries);
+
+  bool setPort(String protocol, String service, String instance, uint16_t port);
+
   bool begin();
 
+  bool begin(const StaticConfiguration & configuration);
+
   bool processQueries();
 
+  Batch processQueries(uint16_t maxPackets, uint32_t maxMicros = 0);
+
+  // Runs whatever is due without reading the socket: delayed responses,
+  // probes, announcements, queries and cache expiry. An application that
+  // sleeps can call processQueries when a packet arrives and this once
+  // getNextDeadline has passed.
+  void processTimers();
+
+  // The millis() time of the next pending action, earlier than now if one is
+  // overdue. Compare it as (long) (deadline - millis()) to survive rollover.
+  unsigned long getNextDeadline();
+
+#if PLATFORM_THREADING
+  // Runs processQueries on a thread of its own, so answers do not wait for
+  // the application loop. From then on calls that change the hostname,
+  // services, TXT data, questions or the buffer size are queued for that
+  // thread and return whether the change was queued; getStatus reports the
+  // outcome once it has been applied. memoryUsage, rateLimits, stats and
+  // resolve read what the thread last published. begin is refused, and
+  // processTimers and getNextDeadline have nothing for the application to
+  // do. These calls are meant to be made from one application thread; browse
+  // callbacks run on the responder thread.
+  bool startThread();
+
+  void stopThread();
+#endif
+
+  bool setBufferSize(uint16_t size);
+
+  MemoryUsage memoryUsage();
+
+  RateLimits rateLimits();
+
+#if MDNS_STATS
+  Stats stats();
+
+  void resetStats();
+#endif
+
+  String getStatus();
+
+  bool browse(String service, String protocol, BrowseCallback callback);
+
+  bool resolve(String hostname, IPAddress & address);
+
 private:
 
-  struct QueryHeader {
-    uint16_t id;
-    uint16_t flags;
-    uint16_t qdcount;
-    uint16_t ancount;
-    uint16_t nscount;
-    uint16_t arcount;
-  };
+#ifdef MDNS_HOST_BUILD
+  // The host benchmark and fuzzer drive the matcher and parser directly.
+  friend class MDNSBench;
+  friend class MDNSFuzzer;
+#endif
 
   UDP * udp = new UDP();
   Buffer * buffer = new Buffer(BUFFER_SIZE);
+  Packet * packet = new Packet(buffer);
+
+  Arena * arena;
 
-  Label * ROOT = new Label("");
-  Label * LOCAL = new Label("local", ROOT);
+  Label * ROOT = new (arena) Label(arena, "");
+  Label * LOCAL = new (arena) Label(arena, "local", ROOT);
   Label::Matcher * matcher = new Label::Matcher();
 
-  ARecord * aRecord;
-  TXTRecord * txtRecord;
+  typedef std::pair<Label *, uint16_t> ResponseKey;
 
-  std::map<String, Label *> labels;
-  std::vector<Record *> records;
-  String status = "Ok";
+  struct CachedResponse {
+    std::vector<uint8_t> data;
+    std::vector<uint16_t> sizes;
+    std::vector<Record *> records;
+    bool shared;
+  };
+
+  std::map<ResponseKey, CachedResponse> responses;
+  IPAddress cachedIP;
+  unsigned long addressTime = 0;
+
+  struct Address {
+    uint16_t type;
+    uint8_t data[IPV6_SIZE];
+  };
+
+  ResponseKey responseKey;
+  bool keyed = false;
+  bool matched = false;
+  bool unicast = false;
+  bool legacy = false;
+  bool probe = false;
+
+  ResponseKey pendingKey;
+  bool pending = false;
+  bool pendingKeyed = false;
+  bool pendingProbe = false;
+  unsigned long pendingTime = 0;
+
+  // The name before any rename, copied into the arena on the first
+  // conflict so the suffix can be replaced rather than stacked.
+  struct Probe {
+    Label * label;
+    char * name;
+    bool host;
+    uint16_t conflicts;
+    bool conflict;
+    bool verified;
+  };
+
+  std::vector<Probe> probes;
+  std::vector<Record *> announcements;
+  uint8_t state = STATE_STOPPED;
+  uint8_t stateCount = 0;
+  unsigned long stateTime = 0;
+  bool deferred = false;
+
+  struct Question {
+    String name;
+    uint16_t type;
+    BrowseCallback callback;
+    unsigned long time;
+    unsigned long interval;
+    uint8_t count;
+  };
+
+  struct CacheEntry {
+    String name;
+    uint16_t type;
+    String target;
+    uint16_t port;
+    uint8_t address[IPV6_SIZE];
+    uint32_t ttl;
+    unsigned long time;
+    uint8_t refreshes;
+    bool reported;
+    bool resolving;
+  };
+
+  std::vector<Question> questions;
+  std::vector<CacheEntry> cache;
+  bool cacheChanged = false;
+
+  struct Source {
+    IPAddress ip;
+    unsigned long time;
+    uint16_t queries;
+  };
+
+  std::vector<Source> sources;
+  RateLimits limits = { 0, 0 };
+
+#if MDNS_STATS
+  Stats counters = Stats();
+  uint32_t sendTicks = 0;
+
+  uint32_t addSample(uint32_t * histogram, uint32_t ticks);
+#endif
+
+  TXTRecord * txtRecord = NULL;
+  HostLabel * hostLabel = NULL;
+  MetaLabel * enumerationLabel = NULL;
+  Label * reverseLabels[2] = { NULL, NULL };
+
+  std::vector<Label *> reverseNames;
+  std::vector<Record *> reverseRecords;
+
+  std::vector<Label *> labels;
+  RecordTable records;
+  std::atomic<const char *> status { "Ok" };
+
+#if PLATFORM_THREADING
+  // Changes queued by the application for the responder thread. Only the
+  // application advances the tail and only the responder the head, so
+  // neither side waits on the other.
+  struct Change {
+    Change(uint8_t type = 0, String protocol = "", String service = "", String instance = "", uint16_t port = 0, std::vector<String> entries = std::vector<String>(), BrowseCallback callback = NULL);
+
+    uint8_t type;
+    String protocol;
+    String service;
+    String instance;
+    uint16_t port;
+    std::vector<String> entries;
+    BrowseCallback callback;
+  };
+
+  Change changes[CHANGE_QUEUE_SIZE];
+  std::atomic<uint32_t> changeHead { 0 };
+  std::atomic<uint32_t> changeTail { 0 };
+  std::atomic<Thread *> thread { NULL };
+  std::atomic<bool> running { false };
+
+  struct ResolvedAddress {
+    String name;
+    IPAddress address;
+    unsigned long expiry;
+  };
+
+  // What the responder thread last published for the application to read.
+  struct Snapshot {
+    MemoryUsage usage;
+    RateLimits limits;
+#if MDNS_STATS
+    Stats stats;
+#endif
+    std::vector<ResolvedAddress> addresses;
+  };
+
+  std::mutex snapshotLock;
+  Snapshot snapshot = Snapshot();
+
+  // Names resolve has queued, and when, on the application's side.
+  std::vector<std::pair<String, unsigned long> > resolving;
+
+  bool isQueued();
+  bool queueChange(const Change & change);
+  void applyChanges();
+  void publish();
+  bool resolvePublished(String name, IPAddress & address);
+  static os_thread_return_t run(void * mdns);
+#endif
 
-  QueryHeader readHeader(Buffer * buffer);
+  bool processPacket(uint16_t size);
+  bool updateNetwork();
+  void updateTimers();
   void getResponses();
-  void writeResponses();
+  void getConflicts();
+  void getProbeConflicts();
+  void getRecordData(Label * label, std::vector<std::vector<uint8_t> > & data);
+  void updateState();
+  void setState(uint8_t state, unsigned long delay);
+  void rename(Probe & probe);
+  void getAnswers();
+  bool isInteresting(String name, uint16_t type);
+  void cacheAnswer(CacheEntry & entry, bool cacheFlush);
+  void updateCache();
+  void writeQueries();
+  void ask(String name, uint16_t type, BrowseCallback callback);
+  Question * findQuestion(String name, uint16_t type);
+  CacheEntry * findEntry(String name, uint16_t type);
+  String readName();
+  void writeName(String name);
+  String unescape(String name);
+  void readAddresses(std::vector<Address> & addresses);
+  bool updateAddresses();
+  void addReverseRecord(uint16_t type, const uint8_t * address);
+  void removeReverseRecords();
+  Record * findPointer(Label * label, Label * target);
+  void addLabel(Label * label);
+  void removeLabels(std::vector<Label *> & removed);
+  bool isSuffix(Label * label);
+  Label * intern(Label * label);
+  void addHost(HostLabel * label, NSECRecord * nsecRecord);
+  TXTRecord * addInstance(InstanceLabel * instanceLabel, ServiceLabel * serviceLabel, ServiceLabel ** subServiceLabels, uint8_t subServiceCount, uint16_t port);
+  bool addService(const StaticService & service);
+  Label * findLabel(String name);
+  Label * findLabel(const uint8_t * name, const uint8_t * parentName, Label * grandparent);
+  Label * findInstance(String protocol, String service, String instance);
+  Record * findRecord(Label * label, uint16_t type);
+  void announce(Record * record);
+  void invalidateResponses(Label * label);
+  void invalidateResponses(Record * record);
+  bool getKnownAnswers(uint16_t count, bool duplicates);
+  void scheduleResponses();
+  bool scheduleRecords();
+  void schedulePendingKey();
+  bool isThrottled(IPAddress ip);
+  bool isRateLimited(std::vector<Record *> & records);
+  void setMulticast(std::vector<Record *> & records);
+  void writeResponses(CachedResponse * cache = NULL, bool unicast = false);
+  bool isProbing(Record * record);
+  bool writeRecord(Record * record, uint32_t maxTTL, bool cacheFlush = true);
+  bool writeProbe(std::vector<Label *> & names, size_t first, size_t count, bool unicast);
+  void writeProbes(bool unicast);
+  void writeRecords(std::vector<Record *> & records, uint32_t maxTTL);
+  void writePacket(uint16_t answerCount, uint16_t additionalCount, uint16_t flags, CachedResponse * cache, bool unicast);
+  void writePendingResponse();
+  void writeUnicastResponse();
+  void sendResponse(CachedResponse & response, IPAddress ip, uint16_t port);
+  std::map<ResponseKey, CachedResponse>::iterator cacheResponse(ResponseKey key);
   bool isAlphaDigitHyphen(String string);
+  bool isAlphaDigitHyphen(const uint8_t * label, bool underscore);
   bool isNetUnicode(String string);
+  bool isNetUnicode(const uint8_t * label);
 };
 
 #endif
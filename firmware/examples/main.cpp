@@ -34,9 +34,16 @@ void setup() {
   if (success) {
     success = mdns.begin();
   }
+
+#if PLATFORM_THREADING
+  if (success) {
+    success = mdns.startThread();
+  }
+#endif
 }
 
 void loop() {
+  // Does nothing once the responder runs on its own thread.
   mdns.processQueries();
 
   TCPClient client = server.available();
@@ -0,0 +1,519 @@
+#include "Particle.h"
+#include "ifapi.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+String::String(const char * cstr) {
+  buffer = NULL;
+  len = 0;
+  assign(cstr, cstr ? strlen(cstr) : 0);
+}
+
+String::String(const String & string) {
+  buffer = NULL;
+  len = 0;
+  assign(string.buffer, string.len);
+}
+
+String::String(char c) {
+  buffer = NULL;
+  len = 0;
+  assign(&c, 1);
+}
+
+String::~String() {
+  delete[] buffer;
+}
+
+String & String::operator=(const String & string) {
+  if (this != &string) {
+    assign(string.buffer, string.len);
+  }
+
+  return *this;
+}
+
+String & String::operator+=(const String & string) {
+  append(string.buffer, string.len);
+  return *this;
+}
+
+String & String::operator+=(const char * cstr) {
+  append(cstr, cstr ? strlen(cstr) : 0);
+  return *this;
+}
+
+String & String::operator+=(char c) {
+  append(&c, 1);
+  return *this;
+}
+
+unsigned int String::length() const {
+  return len;
+}
+
+char String::charAt(unsigned int index) const {
+  return index < len ? buffer[index] : 0;
+}
+
+const char * String::c_str() const {
+  return buffer;
+}
+
+String String::substring(unsigned int from, unsigned int to) const {
+  String result;
+
+  if (to > len) {
+    to = len;
+  }
+
+  if (from < to) {
+    result.assign(buffer + from, to - from);
+  }
+
+  return result;
+}
+
+bool String::endsWith(const String & suffix) const {
+  return suffix.len <= len && memcmp(buffer + len - suffix.len, suffix.buffer, suffix.len) == 0;
+}
+
+bool String::equals(const String & string) const {
+  return len == string.len && memcmp(buffer, string.buffer, len) == 0;
+}
+
+// Like Wiring, an empty string compares equal to NULL.
+bool String::equals(const char * cstr) const {
+  if (len == 0) {
+    return cstr == NULL || *cstr == 0;
+  }
+
+  return cstr != NULL && strcmp(buffer, cstr) == 0;
+}
+
+bool String::equalsIgnoreCase(const String & string) const {
+  return len == string.len && strncasecmp(buffer, string.buffer, len) == 0;
+}
+
+bool String::operator==(const String & string) const {
+  return equals(string);
+}
+
+bool String::operator==(const char * cstr) const {
+  return equals(cstr);
+}
+
+bool String::operator!=(const String & string) const {
+  return !equals(string);
+}
+
+bool String::operator!=(const char * cstr) const {
+  return !equals(cstr);
+}
+
+bool String::operator<(const String & string) const {
+  return strcmp(buffer, string.buffer) < 0;
+}
+
+void String::assign(const char * cstr, unsigned int length) {
+  char * data = new char[length + 1];
+  if (length > 0) {
+    memcpy(data, cstr, length);
+  }
+  data[length] = 0;
+
+  delete[] buffer;
+  buffer = data;
+  len = length;
+}
+
+void String::append(const char * cstr, unsigned int length) {
+  char * data = new char[len + length + 1];
+  memcpy(data, buffer, len);
+  memcpy(data + len, cstr, length);
+  data[len + length] = 0;
+
+  delete[] buffer;
+  buffer = data;
+  len += length;
+}
+
+String operator+(const String & lhs, const String & rhs) {
+  String result = lhs;
+  result += rhs;
+  return result;
+}
+
+String operator+(const char * lhs, const String & rhs) {
+  String result = lhs;
+  result += rhs;
+  return result;
+}
+
+String operator+(const String & lhs, const char * rhs) {
+  String result = lhs;
+  result += rhs;
+  return result;
+}
+
+String operator+(const String & lhs, char rhs) {
+  String result = lhs;
+  result += rhs;
+  return result;
+}
+
+IPAddress::IPAddress() {
+  memset(address, 0, sizeof(address));
+}
+
+IPAddress::IPAddress(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3) {
+  address[0] = b0;
+  address[1] = b1;
+  address[2] = b2;
+  address[3] = b3;
+}
+
+uint8_t IPAddress::operator[](int index) const {
+  return address[index];
+}
+
+uint8_t & IPAddress::operator[](int index) {
+  return address[index];
+}
+
+bool IPAddress::operator==(const IPAddress & ip) const {
+  return memcmp(address, ip.address, sizeof(address)) == 0;
+}
+
+bool IPAddress::operator!=(const IPAddress & ip) const {
+  return !(*this == ip);
+}
+
+IPAddress::operator bool() const {
+  return address[0] || address[1] || address[2] || address[3];
+}
+
+static std::mutex network;
+static std::deque<HostNetwork::Datagram> inbound;
+static std::vector<HostNetwork::Datagram> outbound;
+static bool capturing = true;
+static size_t packetCount = 0;
+static size_t byteCount = 0;
+static std::atomic<unsigned long> now(0);
+
+uint8_t UDP::begin(uint16_t port) {
+  return 1;
+}
+
+void UDP::stop() {
+}
+
+bool UDP::joinMulticast(const IPAddress & ip) {
+  return true;
+}
+
+int UDP::parsePacket() {
+  std::lock_guard<std::mutex> lock(network);
+
+  received.clear();
+  readOffset = 0;
+
+  if (inbound.empty()) {
+    return 0;
+  }
+
+  HostNetwork::Datagram & datagram = inbound.front();
+
+  received.swap(datagram.data);
+  receivedIP = datagram.ip;
+  receivedPort = datagram.port;
+
+  inbound.pop_front();
+
+  return received.size();
+}
+
+int UDP::available() {
+  return received.size() - readOffset;
+}
+
+int UDP::read(uint8_t * buffer, size_t size) {
+  size_t n = received.size() - readOffset;
+
+  if (n > size) {
+    n = size;
+  }
+
+  if (n > 0) {
+    memcpy(buffer, received.data() + readOffset, n);
+    readOffset += n;
+  }
+
+  return n;
+}
+
+void UDP::flush() {
+  readOffset = received.size();
+}
+
+IPAddress UDP::remoteIP() {
+  return receivedIP;
+}
+
+uint16_t UDP::remotePort() {
+  return receivedPort;
+}
+
+int UDP::beginPacket(IPAddress ip, uint16_t port) {
+  sending.clear();
+  sendingIP = ip;
+  sendingPort = port;
+
+  return 1;
+}
+
+size_t UDP::write(const uint8_t * buffer, size_t size) {
+  sending.insert(sending.end(), buffer, buffer + size);
+
+  return size;
+}
+
+int UDP::endPacket() {
+  std::lock_guard<std::mutex> lock(network);
+
+  packetCount++;
+  byteCount += sending.size();
+
+  if (!capturing) {
+    sending.clear();
+    return 1;
+  }
+
+  HostNetwork::Datagram datagram;
+
+  datagram.ip = sendingIP;
+  datagram.port = sendingPort;
+  datagram.data.swap(sending);
+
+  outbound.push_back(datagram);
+
+  return 1;
+}
+
+WiFiClass WiFi;
+
+bool WiFiClass::ready() {
+  return isReady;
+}
+
+IPAddress WiFiClass::localIP() {
+  return ip;
+}
+
+void WiFiClass::setReady(bool ready) {
+  isReady = ready;
+}
+
+void WiFiClass::setLocalIP(IPAddress ip) {
+  this->ip = ip;
+}
+
+void WiFiClass::addLocalIPv6(const uint8_t * address) {
+  ipv6.push_back(std::vector<uint8_t>(address, address + 16));
+}
+
+void WiFiClass::clearLocalIPv6() {
+  ipv6.clear();
+}
+
+std::vector<std::vector<uint8_t> > & WiFiClass::localIPv6() {
+  return ipv6;
+}
+
+int if_get_list(struct if_list ** ifs) {
+  *ifs = new if_list();
+  (*ifs)->next = NULL;
+  (*ifs)->iface = NULL;
+
+  return 0;
+}
+
+int if_free_list(struct if_list * ifs) {
+  delete ifs;
+
+  return 0;
+}
+
+static if_addrs * addAddress(if_addrs * next, sockaddr * addr) {
+  if_addrs * addrs = new if_addrs();
+
+  addrs->next = next;
+  addrs->if_addr = new if_addr();
+  addrs->if_addr->addr = addr;
+
+  return addrs;
+}
+
+int if_get_addrs(if_t iface, struct if_addrs ** addrs) {
+  std::vector<std::vector<uint8_t> > & ipv6 = WiFi.localIPv6();
+
+  *addrs = NULL;
+
+  for (size_t i = ipv6.size(); i > 0; i--) {
+    sockaddr_in6 * addr = new sockaddr_in6();
+
+    addr->sin6_family = AF_INET6;
+    memcpy(&addr->sin6_addr, ipv6[i - 1].data(), 16);
+
+    *addrs = addAddress(*addrs, (sockaddr *) addr);
+  }
+
+  IPAddress ip = WiFi.localIP();
+
+  if (ip) {
+    sockaddr_in * addr = new sockaddr_in();
+    uint8_t * data = (uint8_t *) &addr->sin_addr;
+
+    addr->sin_family = AF_INET;
+
+    for (int i = 0; i < 4; i++) {
+      data[i] = ip[i];
+    }
+
+    *addrs = addAddress(*addrs, (sockaddr *) addr);
+  }
+
+  return 0;
+}
+
+int if_free_if_addrs(struct if_addrs * addrs) {
+  while (addrs != NULL) {
+    if_addrs * next = addrs->next;
+
+    if (addrs->if_addr->addr->sa_family == AF_INET6) {
+      delete (sockaddr_in6 *) addrs->if_addr->addr;
+    } else {
+      delete (sockaddr_in *) addrs->if_addr->addr;
+    }
+
+    delete addrs->if_addr;
+    delete addrs;
+
+    addrs = next;
+  }
+
+  return 0;
+}
+
+SystemClass System;
+
+Thread::Thread(const char * name, os_thread_fn_t function, void * param, os_thread_prio_t priority, size_t stackSize) : thread(function, param) {
+}
+
+bool Thread::join() {
+  thread.join();
+
+  return true;
+}
+
+bool Thread::is_current() {
+  return thread.get_id() == std::this_thread::get_id();
+}
+
+int os_thread_delay_until(system_tick_t * previousWakeTime, system_tick_t increment) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(increment));
+
+  *previousWakeTime += increment;
+
+  return 0;
+}
+
+int os_thread_exit(void * thread) {
+  return 0;
+}
+
+uint32_t SystemClass::ticks() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint32_t SystemClass::ticksPerMicrosecond() {
+  return 1000;
+}
+
+unsigned long millis() {
+  return now;
+}
+
+unsigned long micros() {
+  return now * 1000;
+}
+
+void delay(unsigned long ms) {
+  now += ms;
+}
+
+long random(long max) {
+  return max > 0 ? rand() % max : 0;
+}
+
+long random(long min, long max) {
+  return min < max ? min + random(max - min) : min;
+}
+
+void HostNetwork::receive(const uint8_t * data, size_t size, IPAddress ip, uint16_t port) {
+  Datagram datagram;
+
+  datagram.ip = ip;
+  datagram.port = port;
+  datagram.data.assign(data, data + size);
+
+  std::lock_guard<std::mutex> lock(network);
+
+  inbound.push_back(datagram);
+}
+
+size_t HostNetwork::pending() {
+  std::lock_guard<std::mutex> lock(network);
+
+  return inbound.size();
+}
+
+std::vector<HostNetwork::Datagram> & HostNetwork::sent() {
+  return outbound;
+}
+
+size_t HostNetwork::sentPackets() {
+  std::lock_guard<std::mutex> lock(network);
+
+  return packetCount;
+}
+
+size_t HostNetwork::sentBytes() {
+  std::lock_guard<std::mutex> lock(network);
+
+  return byteCount;
+}
+
+void HostNetwork::capture(bool enabled) {
+  std::lock_guard<std::mutex> lock(network);
+
+  capturing = enabled;
+}
+
+void HostNetwork::clear() {
+  std::lock_guard<std::mutex> lock(network);
+
+  inbound.clear();
+  outbound.clear();
+  packetCount = 0;
+  byteCount = 0;
+}
+
+void HostClock::set(unsigned long ms) {
+  now = ms;
+}
+
+void HostClock::advance(unsigned long ms) {
+  now += ms;
+}
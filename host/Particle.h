@@ -0,0 +1,202 @@
+// Host stand-in for the subset of the Particle Device OS API used by the MDNS
+// library. It lets firmware/MDNS.cpp build and run on a development machine:
+// UDP datagrams are fed in and captured through HostNetwork, and time only
+// moves when HostClock is advanced.
+
+#ifndef _INCL_PARTICLE_HOST
+#define _INCL_PARTICLE_HOST
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#define HAL_PLATFORM_IFAPI 1
+#define PLATFORM_THREADING 1
+
+#define OS_THREAD_PRIORITY_DEFAULT 2
+
+class String {
+public:
+  String(const char * cstr = "");
+  String(const String & string);
+  explicit String(char c);
+  ~String();
+
+  String & operator=(const String & string);
+  String & operator+=(const String & string);
+  String & operator+=(const char * cstr);
+  String & operator+=(char c);
+
+  unsigned int length() const;
+  char charAt(unsigned int index) const;
+  const char * c_str() const;
+  String substring(unsigned int from, unsigned int to) const;
+  bool endsWith(const String & suffix) const;
+
+  bool equals(const String & string) const;
+  bool equals(const char * cstr) const;
+  bool equalsIgnoreCase(const String & string) const;
+
+  bool operator==(const String & string) const;
+  bool operator==(const char * cstr) const;
+  bool operator!=(const String & string) const;
+  bool operator!=(const char * cstr) const;
+  bool operator<(const String & string) const;
+
+private:
+  char * buffer;
+  unsigned int len;
+
+  void assign(const char * cstr, unsigned int length);
+  void append(const char * cstr, unsigned int length);
+};
+
+String operator+(const String & lhs, const String & rhs);
+String operator+(const char * lhs, const String & rhs);
+String operator+(const String & lhs, const char * rhs);
+String operator+(const String & lhs, char rhs);
+
+class IPAddress {
+public:
+  IPAddress();
+  IPAddress(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3);
+
+  uint8_t operator[](int index) const;
+  uint8_t & operator[](int index);
+
+  bool operator==(const IPAddress & address) const;
+  bool operator!=(const IPAddress & address) const;
+
+  operator bool() const;
+
+private:
+  uint8_t address[4];
+};
+
+class UDP {
+public:
+  uint8_t begin(uint16_t port);
+  void stop();
+
+  bool joinMulticast(const IPAddress & ip);
+
+  int parsePacket();
+  int available();
+  int read(uint8_t * buffer, size_t size);
+  void flush();
+
+  IPAddress remoteIP();
+  uint16_t remotePort();
+
+  int beginPacket(IPAddress ip, uint16_t port);
+  size_t write(const uint8_t * buffer, size_t size);
+  int endPacket();
+
+private:
+  std::vector<uint8_t> received;
+  size_t readOffset = 0;
+  IPAddress receivedIP;
+  uint16_t receivedPort = 0;
+
+  std::vector<uint8_t> sending;
+  IPAddress sendingIP;
+  uint16_t sendingPort = 0;
+};
+
+class WiFiClass {
+public:
+  bool ready();
+  IPAddress localIP();
+
+  void setReady(bool ready);
+  void setLocalIP(IPAddress ip);
+
+  // IPv6 addresses are only visible through the interface API, as on
+  // Device OS.
+  void addLocalIPv6(const uint8_t * address);
+  void clearLocalIPv6();
+  std::vector<std::vector<uint8_t> > & localIPv6();
+
+private:
+  bool isReady = true;
+  IPAddress ip = IPAddress(192, 168, 1, 10);
+  std::vector<std::vector<uint8_t> > ipv6;
+};
+
+extern WiFiClass WiFi;
+
+// Ticks are nanoseconds of the host's monotonic clock, independent of
+// HostClock, so timings measured with them are real.
+class SystemClass {
+public:
+  uint32_t ticks();
+  uint32_t ticksPerMicrosecond();
+};
+
+extern SystemClass System;
+
+// Threads are real, and so is the time they wait in os_thread_delay_until,
+// unlike delay.
+typedef uint32_t system_tick_t;
+typedef uint8_t os_thread_prio_t;
+typedef void os_thread_return_t;
+typedef os_thread_return_t (*os_thread_fn_t)(void * param);
+
+class Thread {
+public:
+  Thread(const char * name, os_thread_fn_t function, void * param = NULL, os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT, size_t stackSize = 0);
+
+  bool join();
+  bool is_current();
+
+private:
+  std::thread thread;
+};
+
+int os_thread_delay_until(system_tick_t * previousWakeTime, system_tick_t increment);
+int os_thread_exit(void * thread);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+long random(long max);
+long random(long min, long max);
+
+namespace HostNetwork {
+  struct Datagram {
+    IPAddress ip;
+    uint16_t port;
+    std::vector<uint8_t> data;
+  };
+
+  void receive(const uint8_t * data, size_t size, IPAddress ip = IPAddress(192, 168, 1, 20), uint16_t port = 5353);
+
+  size_t pending();
+
+  std::vector<Datagram> & sent();
+
+  size_t sentPackets();
+
+  size_t sentBytes();
+
+  // Datagrams can be received and counted while a responder thread runs,
+  // but sent() is only safe to read once it has stopped.
+  //
+  // Sent datagrams are still counted when capture is off, but not stored,
+  // so the stand-in itself does not allocate on the send path.
+  void capture(bool enabled);
+
+  void clear();
+}
+
+namespace HostClock {
+  void set(unsigned long ms);
+
+  void advance(unsigned long ms);
+}
+
+#endif
@@ -0,0 +1,374 @@
+// Benchmark for the responder hot paths on the host build.
+//
+// For a range of configurations, from a bare host to hundreds of services
+// with subtypes, it replays a fixed mix of questions, optionally carrying the
+// known answers a browser with a warm cache would send, and reports:
+//
+// - time spent in Label::Matcher::match, in Packet::read plus
+//   MDNS::getResponses, and in MDNS::writeResponses, per question;
+// - end-to-end queries per second through MDNS::processQueries, for the
+//   whole mix, for one question repeated back to back, and for the mix
+//   arriving in bursts drained by one batched call;
+// - heap traffic and response bytes per packet, and datagrams sent per query
+//   in the burst case.
+
+#include "MDNS.h"
+#include <chrono>
+#include <new>
+#include <stdio.h>
+
+#define BURST_SIZE 16
+
+static bool counting = false;
+static size_t allocatedBytes = 0;
+static size_t allocationCount = 0;
+
+void * operator new(size_t size) {
+  if (counting) {
+    allocatedBytes += size;
+    allocationCount++;
+  }
+
+  void * p = malloc(size > 0 ? size : 1);
+
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+
+  return p;
+}
+
+void operator delete(void * p) noexcept {
+  free(p);
+}
+
+void operator delete(void * p, size_t size) noexcept {
+  free(p);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static uint64_t elapsed(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+class Query {
+public:
+  Query(uint16_t id = 0) {
+    uint8_t header[12] = { (uint8_t) (id >> 8), (uint8_t) id };
+    data.assign(header, header + sizeof(header));
+  }
+
+  Query & question(const char * name, uint16_t type, uint16_t cls = IN_CLASS) {
+    writeName(name);
+    writeUInt16(type);
+    writeUInt16(cls);
+    data[5]++;
+    return *this;
+  }
+
+  Query & knownAnswer(const char * name, uint16_t type, uint32_t ttl, const char * target) {
+    writeName(name);
+    writeUInt16(type);
+    writeUInt16(IN_CLASS);
+    writeUInt16(ttl >> 16);
+    writeUInt16(ttl);
+
+    size_t offset = data.size();
+
+    writeUInt16(0);
+    writeName(target);
+
+    uint16_t length = data.size() - offset - 2;
+
+    data[offset] = length >> 8;
+    data[offset + 1] = length;
+    data[7]++;
+    return *this;
+  }
+
+  std::vector<uint8_t> data;
+
+private:
+  void writeName(const char * name) {
+    while (*name) {
+      const char * dot = strchr(name, DOT);
+      size_t size = dot ? dot - name : strlen(name);
+
+      data.push_back(size);
+      data.insert(data.end(), name, name + size);
+
+      name += dot ? size + 1 : size;
+    }
+
+    data.push_back(END_OF_NAME);
+  }
+
+  void writeUInt16(uint16_t value) {
+    data.push_back(value >> 8);
+    data.push_back(value);
+  }
+};
+
+struct Result {
+  uint64_t matchNanos = 0;
+  uint64_t getResponsesNanos = 0;
+  uint64_t writeResponsesNanos = 0;
+  uint64_t processNanos = 0;
+  uint64_t hotNanos = 0;
+  uint64_t burstNanos = 0;
+  size_t questions = 0;
+  size_t packets = 0;
+  size_t hotPackets = 0;
+  size_t burstPackets = 0;
+  size_t burstResponses = 0;
+  size_t allocatedBytes = 0;
+  size_t allocations = 0;
+  size_t responseBytes = 0;
+};
+
+class MDNSBench {
+public:
+  MDNSBench(int services, int subtypes, int instances, bool knownAnswers) {
+    char name[64];
+    char instance[64];
+
+    mdns.setHostname("bench");
+
+    for (int i = 0; i < services; i++) {
+      std::vector<String> subServices;
+
+      for (int j = 0; j < subtypes; j++) {
+        snprintf(name, sizeof(name), "sub%d", j);
+        subServices.push_back(name);
+      }
+
+      for (int k = 0; k < instances; k++) {
+        snprintf(name, sizeof(name), "svc%d", i);
+        snprintf(instance, sizeof(instance), "Instance %d-%d", i, k);
+
+        mdns.addService("tcp", name, 1000 + i, instance, subServices);
+
+        snprintf(name, sizeof(name), "%d", k);
+        mdns.addTXTEntry("instance", name);
+      }
+    }
+
+    mdns.begin();
+
+    // Let probing and announcing finish before measuring.
+    for (int n = 0; n < 40; n++) {
+      mdns.processQueries();
+      HostClock::advance(PROBE_INTERVAL);
+    }
+
+    HostNetwork::clear();
+
+    queries.push_back(Query().question("bench.local", A_TYPE));
+    queries.push_back(Query().question("unknown.local", A_TYPE));
+
+    for (int i = 0; i < services; i++) {
+      snprintf(name, sizeof(name), "_svc%d._tcp.local", i);
+      queries.push_back(Query().question(name, PTR_TYPE));
+
+      for (int k = 0; knownAnswers && k < instances; k++) {
+        snprintf(instance, sizeof(instance), "Instance %d-%d._svc%d._tcp.local", i, k, i);
+        queries.back().knownAnswer(name, PTR_TYPE, TTL_75MIN, instance);
+      }
+
+      snprintf(name, sizeof(name), "Instance %d-0._svc%d._tcp.local", i, i);
+      queries.push_back(Query().question(name, SRV_TYPE));
+
+      if (subtypes > 0) {
+        snprintf(name, sizeof(name), "_sub%d._sub._svc%d._tcp.local", i % subtypes, i);
+        queries.push_back(Query().question(name, PTR_TYPE));
+      }
+    }
+  }
+
+  Result run(int iterations) {
+    Result result;
+
+    HostNetwork::capture(false);
+
+    for (int n = 0; n < iterations; n++) {
+      for (size_t q = 0; q < queries.size(); q++) {
+        load(queries[q]);
+
+        Clock::time_point start = Clock::now();
+        mdns.buffer->setOffset(12);
+        mdns.matcher->match(mdns.buffer);
+        result.matchNanos += elapsed(start);
+
+        mdns.responses.clear();
+
+        start = Clock::now();
+        mdns.packet->read();
+        mdns.getResponses();
+        result.getResponsesNanos += elapsed(start);
+
+        mdns.buffer->clear();
+
+        if (mdns.keyed) {
+          mdns.responseKey.first->matched(mdns.responseKey.second, IN_CLASS);
+        }
+
+        mdns.scheduleRecords();
+
+        start = Clock::now();
+        mdns.writeResponses();
+        result.writeResponsesNanos += elapsed(start);
+
+        mdns.buffer->clear();
+
+        HostClock::advance(MULTICAST_INTERVAL);
+
+        result.questions++;
+      }
+    }
+
+    HostNetwork::clear();
+
+    allocatedBytes = 0;
+    allocationCount = 0;
+
+    for (int n = 0; n < iterations; n++) {
+      for (size_t q = 0; q < queries.size(); q++) {
+        result.processNanos += process(queries[q]);
+        result.packets++;
+      }
+    }
+
+    result.allocatedBytes = allocatedBytes;
+    result.allocations = allocationCount;
+    result.responseBytes = HostNetwork::sentBytes();
+
+    Query & hot = queries[queries.size() > 2 ? 2 : 0];
+
+    for (int n = 0; n < iterations * (int) queries.size(); n++) {
+      result.hotNanos += process(hot);
+      result.hotPackets++;
+    }
+
+    HostNetwork::clear();
+
+    for (int n = 0; n < iterations; n++) {
+      for (size_t q = 0; q < queries.size(); q += BURST_SIZE) {
+        result.burstNanos += burst(q);
+      }
+    }
+
+    result.burstPackets = iterations * queries.size();
+    result.burstResponses = HostNetwork::sentPackets();
+
+    HostNetwork::capture(true);
+    HostNetwork::clear();
+
+    return result;
+  }
+
+private:
+  MDNS mdns;
+  std::vector<Query> queries;
+
+  // Each query is answered before the next one arrives: the clock runs past
+  // the longest response delay and the per-record multicast interval, so
+  // nothing is aggregated or suppressed across queries.
+  uint64_t process(Query & query) {
+    HostNetwork::receive(query.data.data(), query.data.size());
+
+    counting = true;
+
+    Clock::time_point start = Clock::now();
+
+    mdns.processQueries();
+    HostClock::advance(SHARED_RESPONSE_MAX_DELAY);
+    mdns.processQueries();
+
+    uint64_t nanos = elapsed(start);
+
+    HostClock::advance(MULTICAST_INTERVAL);
+
+    counting = false;
+
+    return nanos;
+  }
+
+  // A burst of queued queries is drained by one batched call, and whatever
+  // it scheduled is flushed once the response delay has passed.
+  uint64_t burst(size_t first) {
+    for (size_t q = first; q < first + BURST_SIZE && q < queries.size(); q++) {
+      HostNetwork::receive(queries[q].data.data(), queries[q].data.size());
+    }
+
+    Clock::time_point start = Clock::now();
+
+    mdns.processQueries(BURST_SIZE);
+    HostClock::advance(SHARED_RESPONSE_MAX_DELAY);
+    mdns.processQueries(BURST_SIZE);
+
+    uint64_t nanos = elapsed(start);
+
+    HostClock::advance(MULTICAST_INTERVAL);
+
+    return nanos;
+  }
+
+  void load(Query & query) {
+    HostNetwork::receive(query.data.data(), query.data.size());
+
+    mdns.udp->parsePacket();
+    mdns.buffer->read(mdns.udp);
+  }
+};
+
+struct Configuration {
+  const char * name;
+  int services;
+  int subtypes;
+  int instances;
+  bool knownAnswers;
+};
+
+static const Configuration CONFIGURATIONS[] = {
+  { "host only", 0, 0, 1, false },
+  { "1 service", 1, 0, 1, false },
+  { "10 services x 2 subtypes", 10, 2, 1, false },
+  { "50 services x 4 subtypes", 50, 4, 1, false },
+  { "200 services x 2 subtypes", 200, 2, 1, false },
+  { "500 services", 500, 0, 1, false },
+  { "8 services x 8 instances", 8, 1, 8, false },
+  { "  with known answers", 8, 1, 8, true },
+};
+
+int main(int argc, char ** argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+
+  printf("%-28s %10s %10s %12s %12s %12s %12s %11s %10s %10s %10s\n",
+    "configuration", "match ns", "getResp ns", "writeResp ns", "queries/s", "hot q/s", "burst q/s", "alloc B/pkt", "allocs/pkt", "resp B/pkt", "burst out");
+
+  for (size_t i = 0; i < sizeof(CONFIGURATIONS) / sizeof(CONFIGURATIONS[0]); i++) {
+    const Configuration & configuration = CONFIGURATIONS[i];
+
+    MDNSBench bench(configuration.services, configuration.subtypes, configuration.instances, configuration.knownAnswers);
+
+    int scaled = iterations / (configuration.services / 10 + 1) + 1;
+
+    Result result = bench.run(scaled);
+
+    printf("%-28s %10.1f %10.1f %12.1f %12.0f %12.0f %12.0f %11.1f %10.2f %10.1f %10.2f\n",
+      configuration.name,
+      (double) result.matchNanos / result.questions,
+      (double) result.getResponsesNanos / result.questions,
+      (double) result.writeResponsesNanos / result.questions,
+      result.packets * 1e9 / result.processNanos,
+      result.hotPackets * 1e9 / result.hotNanos,
+      result.burstPackets * 1e9 / result.burstNanos,
+      (double) result.allocatedBytes / result.packets,
+      (double) result.allocations / result.packets,
+      (double) result.responseBytes / result.packets,
+      (double) result.burstResponses / result.burstPackets);
+  }
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+// libFuzzer target for the packet parser, the label reader and the matcher.
+//
+// Each input is one datagram. It is first delivered through
+// MDNS::processQueries, so it goes through validation like any received
+// packet. It is then loaded straight into the buffer and handed to
+// MDNS::getResponses whether it validated or not, with whatever section
+// counts the validator settled on, so the readers behind it see malformed
+// data too. Inputs with a non-zero ID come from a legacy port, the others
+// from port 5353.
+//
+// The responder publishes a host with IPv4 and IPv6 addresses, services with
+// subtypes and TXT data, and browses and resolves names, so queries, probes
+// and responses all reach the code that handles them. Its state carries over
+// between inputs, and the clock moves one second per input so rate limits
+// never mask a path.
+//
+// Built with -DFUZZ_STANDALONE, the target instead runs the files given on
+// the command line once each, which replays a corpus under the sanitizers
+// without libFuzzer.
+
+#include "MDNS.h"
+#include <stdio.h>
+
+#define LEGACY_PORT 40000
+
+static void browseCallback(String instance, String host, uint16_t port, bool available) {
+}
+
+class MDNSFuzzer {
+public:
+  MDNSFuzzer() {
+    uint8_t ipv6[IPV6_SIZE] = { 0xfe, 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x0a };
+    std::vector<String> subServices;
+
+    subServices.push_back("printer");
+
+    WiFi.addLocalIPv6(ipv6);
+
+    mdns.setHostname("fuzz");
+    mdns.addService("tcp", "http", 80, "Fuzz web", subServices);
+    mdns.addTXTEntry("path", "/");
+    mdns.addService("udp", "osc", 9000, "Fuzz osc");
+    mdns.begin();
+
+    for (int n = 0; n < 40; n++) {
+      mdns.processQueries();
+      HostClock::advance(PROBE_INTERVAL);
+    }
+
+    mdns.browse("http", "tcp", browseCallback);
+
+    IPAddress address;
+
+    mdns.resolve("peer", address);
+
+    HostNetwork::capture(false);
+  }
+
+  void run(const uint8_t * data, size_t size) {
+    IPAddress ip(192, 168, 1, 20);
+    uint16_t port = size >= 2 && (data[0] || data[1]) ? LEGACY_PORT : MDNS_PORT;
+
+    HostNetwork::receive(data, size, ip, port);
+
+    mdns.processQueries();
+
+    HostNetwork::receive(data, size, ip, port);
+
+    mdns.udp->parsePacket();
+    mdns.buffer->read(mdns.udp);
+    mdns.udp->flush();
+
+    mdns.packet->read(size > mdns.buffer->available());
+
+    mdns.getResponses();
+    mdns.buffer->clear();
+    mdns.scheduleResponses();
+    mdns.buffer->clear();
+
+    HostClock::advance(MULTICAST_INTERVAL);
+
+    mdns.processQueries();
+
+    HostNetwork::clear();
+  }
+
+private:
+  MDNS mdns;
+};
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+  static MDNSFuzzer fuzzer;
+
+  fuzzer.run(data, size);
+
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char ** argv) {
+  for (int i = 1; i < argc; i++) {
+    FILE * file = fopen(argv[i], "rb");
+
+    if (file == NULL) {
+      fprintf(stderr, "%s: cannot open\n", argv[i]);
+      return 1;
+    }
+
+    std::vector<uint8_t> data;
+    uint8_t chunk[512];
+    size_t n;
+
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+      data.insert(data.end(), chunk, chunk + n);
+    }
+
+    fclose(file);
+
+    LLVMFuzzerTestOneInput(data.data(), data.size());
+  }
+
+  printf("%d inputs\n", argc - 1);
+
+  return 0;
+}
+#endif
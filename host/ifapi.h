@@ -0,0 +1,35 @@
+// Host stand-in for the part of the Device OS network interface API
+// (hal/inc/ifapi.h) that the MDNS library reads addresses through. The host
+// has a single interface carrying the addresses set on WiFi.
+
+#ifndef _INCL_IFAPI_HOST
+#define _INCL_IFAPI_HOST
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+typedef struct if_tag * if_t;
+
+struct if_list {
+  struct if_list * next;
+  if_t iface;
+};
+
+struct if_addr {
+  struct sockaddr * addr;
+  struct sockaddr * netmask;
+  struct sockaddr * gw;
+  uint8_t prefixlen;
+};
+
+struct if_addrs {
+  struct if_addrs * next;
+  struct if_addr * if_addr;
+};
+
+int if_get_list(struct if_list ** ifs);
+int if_free_list(struct if_list * ifs);
+int if_get_addrs(if_t iface, struct if_addrs ** addrs);
+int if_free_if_addrs(struct if_addrs * addrs);
+
+#endif
@@ -0,0 +1,637 @@
+// Replays a packet capture through the responder on the host build.
+//
+// Every UDP datagram sent to port 5353 in a pcap or pcapng file is fed to
+// MDNS::processQueries at its captured time, relative to the first one, with
+// its source address and port. Whatever the responder sends while handling
+// it, including delayed shared answers, is attributed to that packet.
+//
+// The report gives the wall-clock latency of handling each packet, the number
+// and size of responses and the library's own statistics. Responses can be
+// written to a golden file with -w and compared against one with -g, in
+// which case the exit status is non-zero if any packet was answered
+// differently.
+//
+// Captures from IPv6 networks are replayed too, but since the stand-in UDP
+// only knows IPv4 addresses, sources are told apart by the last four bytes
+// of their address.
+
+#include "MDNS.h"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <unistd.h>
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_NANO_MAGIC 0xa1b23c4d
+#define PCAPNG_SECTION_BLOCK 0x0a0d0d0a
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_INTERFACE_BLOCK 1
+#define PCAPNG_SIMPLE_PACKET_BLOCK 3
+#define PCAPNG_ENHANCED_PACKET_BLOCK 6
+#define PCAPNG_TSRESOL_OPTION 9
+
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_LINUX_SLL2 276
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86dd
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+
+#define UDP_PROTOCOL 17
+
+#define DIFF_REPORT_LIMIT 10
+
+typedef std::chrono::steady_clock Clock;
+
+struct Frame {
+  uint64_t micros;
+  IPAddress ip;
+  uint16_t port;
+  const uint8_t * data;
+  size_t size;
+};
+
+class Capture {
+public:
+  size_t skipped = 0;
+
+  bool read(const char * path, std::vector<Frame> & frames) {
+    FILE * file = fopen(path, "rb");
+
+    if (file == NULL) {
+      return false;
+    }
+
+    uint8_t chunk[4096];
+    size_t n;
+
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+      data.insert(data.end(), chunk, chunk + n);
+    }
+
+    fclose(file);
+
+    if (data.size() < 24) {
+      return false;
+    }
+
+    swapped = false;
+
+    if (readUInt32(0) == PCAPNG_SECTION_BLOCK) {
+      return readBlocks(frames);
+    }
+
+    uint32_t magic = readUInt32(0);
+
+    if (magic != PCAP_MAGIC && magic != PCAP_NANO_MAGIC) {
+      swapped = true;
+      magic = readUInt32(0);
+    }
+
+    if (magic != PCAP_MAGIC && magic != PCAP_NANO_MAGIC) {
+      return false;
+    }
+
+    return readRecords(frames, readUInt32(20), magic == PCAP_NANO_MAGIC ? 1000 : 1);
+  }
+
+private:
+  struct Interface {
+    uint16_t linkType;
+    uint64_t ticksPerSecond;
+  };
+
+  std::vector<uint8_t> data;
+  std::vector<Interface> interfaces;
+  bool swapped = false;
+
+  bool readRecords(std::vector<Frame> & frames, uint32_t linkType, uint32_t ticksPerMicro) {
+    size_t offset = 24;
+
+    while (offset + 16 <= data.size()) {
+      uint64_t seconds = readUInt32(offset);
+      uint64_t fraction = readUInt32(offset + 4);
+      size_t length = readUInt32(offset + 8);
+
+      offset += 16;
+
+      if (length > data.size() - offset) {
+        return false;
+      }
+
+      addFrame(frames, linkType, seconds * 1000000 + fraction / ticksPerMicro, offset, length);
+
+      offset += length;
+    }
+
+    return true;
+  }
+
+  bool readBlocks(std::vector<Frame> & frames) {
+    size_t offset = 0;
+    uint64_t micros = 0;
+
+    while (offset + 12 <= data.size()) {
+      uint32_t type = readUInt32(offset);
+
+      // The block type reads the same in either byte order, the magic after
+      // the length tells which one the section uses.
+      if (type == PCAPNG_SECTION_BLOCK) {
+        swapped = false;
+        swapped = readUInt32(offset + 8) != PCAPNG_BYTE_ORDER_MAGIC;
+        interfaces.clear();
+      }
+
+      size_t length = readUInt32(offset + 4);
+
+      if (length < 12 || length > data.size() - offset) {
+        return false;
+      }
+
+      size_t body = offset + 8;
+      size_t end = offset + length - 4;
+
+      if (type == PCAPNG_INTERFACE_BLOCK && body + 8 <= end) {
+        Interface interface = { (uint16_t) readUInt16(body), 1000000 };
+
+        readOptions(interface, body + 8, end);
+
+        interfaces.push_back(interface);
+      } else if (type == PCAPNG_ENHANCED_PACKET_BLOCK && body + 20 <= end) {
+        uint32_t id = readUInt32(body);
+        uint64_t ticks = (uint64_t) readUInt32(body + 4) << 32 | readUInt32(body + 8);
+        size_t captured = readUInt32(body + 12);
+
+        if (id < interfaces.size() && captured <= end - body - 20) {
+          micros = ticks / interfaces[id].ticksPerSecond * 1000000 + ticks % interfaces[id].ticksPerSecond * 1000000 / interfaces[id].ticksPerSecond;
+
+          addFrame(frames, interfaces[id].linkType, micros, body + 20, captured);
+        } else {
+          skipped++;
+        }
+      } else if (type == PCAPNG_SIMPLE_PACKET_BLOCK && body + 4 <= end && !interfaces.empty()) {
+        size_t captured = std::min((size_t) readUInt32(body), end - body - 4);
+
+        addFrame(frames, interfaces[0].linkType, micros, body + 4, captured);
+      }
+
+      offset += length;
+    }
+
+    return true;
+  }
+
+  void readOptions(Interface & interface, size_t offset, size_t end) {
+    while (offset + 4 <= end) {
+      uint16_t code = readUInt16(offset);
+      uint16_t length = readUInt16(offset + 2);
+
+      if (code == PCAPNG_TSRESOL_OPTION && length == 1 && offset + 5 <= end) {
+        uint8_t resolution = data[offset + 4];
+
+        interface.ticksPerSecond = 1;
+
+        for (int i = 0; i < (resolution & 0x7f); i++) {
+          interface.ticksPerSecond *= (resolution & 0x80) ? 2 : 10;
+        }
+      }
+
+      if (code == 0) {
+        return;
+      }
+
+      offset += 4 + ((length + 3) & ~3);
+    }
+  }
+
+  // Link, IP and UDP headers are always big-endian, whatever the byte order
+  // of the capture file.
+  void addFrame(std::vector<Frame> & frames, uint32_t linkType, uint64_t micros, size_t offset, size_t length) {
+    const uint8_t * p = data.data() + offset;
+    size_t size = length;
+    uint16_t etherType = 0;
+
+    if (linkType == LINKTYPE_ETHERNET && size >= 14) {
+      etherType = p[12] << 8 | p[13];
+      p += 14;
+      size -= 14;
+
+      while ((etherType == ETHERTYPE_VLAN || etherType == ETHERTYPE_QINQ) && size >= 4) {
+        etherType = p[2] << 8 | p[3];
+        p += 4;
+        size -= 4;
+      }
+    } else if (linkType == LINKTYPE_LINUX_SLL && size >= 16) {
+      etherType = p[14] << 8 | p[15];
+      p += 16;
+      size -= 16;
+    } else if (linkType == LINKTYPE_LINUX_SLL2 && size >= 20) {
+      etherType = p[0] << 8 | p[1];
+      p += 20;
+      size -= 20;
+    } else if ((linkType == LINKTYPE_RAW || linkType == LINKTYPE_NULL) && size >= 4) {
+      if (linkType == LINKTYPE_NULL) {
+        p += 4;
+        size -= 4;
+      }
+
+      etherType = size > 0 && (p[0] >> 4) == 6 ? ETHERTYPE_IPV6 : ETHERTYPE_IPV4;
+    }
+
+    Frame frame;
+    uint8_t protocol = 0;
+
+    if (etherType == ETHERTYPE_IPV4 && size >= 20 && (p[0] >> 4) == 4) {
+      size_t headerSize = (p[0] & 0x0f) * 4;
+      size_t totalSize = p[2] << 8 | p[3];
+      bool fragment = ((p[6] << 8 | p[7]) & 0x3fff) != 0;
+
+      protocol = fragment ? 0 : p[9];
+      frame.ip = IPAddress(p[12], p[13], p[14], p[15]);
+
+      size = std::min(size, totalSize);
+      size = headerSize <= size ? size - headerSize : 0;
+      p += headerSize;
+    } else if (etherType == ETHERTYPE_IPV6 && size >= 40 && (p[0] >> 4) == 6) {
+      size_t payloadSize = p[4] << 8 | p[5];
+
+      protocol = p[6];
+      frame.ip = IPAddress(p[20], p[21], p[22], p[23]);
+
+      size = std::min(size - 40, payloadSize);
+      p += 40;
+
+      // Hop-by-hop, routing and destination options headers.
+      while ((protocol == 0 || protocol == 43 || protocol == 60) && size >= 8 && (size_t) (p[1] + 1) * 8 <= size) {
+        size_t headerSize = (p[1] + 1) * 8;
+
+        protocol = p[0];
+        p += headerSize;
+        size -= headerSize;
+      }
+    }
+
+    if (protocol != UDP_PROTOCOL || size < 8 || (p[2] << 8 | p[3]) != MDNS_PORT || (p[4] << 8 | p[5]) < 8) {
+      skipped++;
+      return;
+    }
+
+    frame.port = p[0] << 8 | p[1];
+    frame.micros = micros;
+    frame.data = p + 8;
+    frame.size = std::min(size, (size_t) (p[4] << 8 | p[5])) - 8;
+
+    frames.push_back(frame);
+  }
+
+  uint16_t readUInt16(size_t offset) {
+    uint16_t value = data[offset] | data[offset + 1] << 8;
+
+    return swapped ? (uint16_t) (value << 8 | value >> 8) : value;
+  }
+
+  uint32_t readUInt32(size_t offset) {
+    uint32_t value = data[offset] | data[offset + 1] << 8 | data[offset + 2] << 16 | (uint32_t) data[offset + 3] << 24;
+
+    return swapped ? __builtin_bswap32(value) : value;
+  }
+};
+
+static std::string toHex(const std::vector<uint8_t> & data) {
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+
+  for (size_t i = 0; i < data.size(); i++) {
+    hex += digits[data[i] >> 4];
+    hex += digits[data[i] & 0x0f];
+  }
+
+  return hex;
+}
+
+// Golden files hold one line per response: the index of the packet that
+// caused it, its destination and its bytes in hex.
+static std::string describe(size_t index, const HostNetwork::Datagram & datagram) {
+  char prefix[64];
+
+  snprintf(prefix, sizeof(prefix), "%zu %d.%d.%d.%d:%u ", index, datagram.ip[0], datagram.ip[1], datagram.ip[2], datagram.ip[3], datagram.port);
+
+  return prefix + toHex(datagram.data);
+}
+
+static bool readGolden(const char * path, std::map<size_t, std::vector<std::string> > & golden) {
+  FILE * file = fopen(path, "r");
+
+  if (file == NULL) {
+    return false;
+  }
+
+  std::string line;
+  int c;
+
+  while ((c = fgetc(file)) != EOF) {
+    if (c != '\n') {
+      line += (char) c;
+      continue;
+    }
+
+    if (!line.empty()) {
+      golden[strtoul(line.c_str(), NULL, 10)].push_back(line);
+    }
+
+    line.clear();
+  }
+
+  fclose(file);
+
+  return true;
+}
+
+static bool parseAddress(const char * text, IPAddress & ip) {
+  unsigned int b[4];
+
+  if (sscanf(text, "%u.%u.%u.%u", &b[0], &b[1], &b[2], &b[3]) != 4 || b[0] > 255 || b[1] > 255 || b[2] > 255 || b[3] > 255) {
+    return false;
+  }
+
+  ip = IPAddress(b[0], b[1], b[2], b[3]);
+
+  return true;
+}
+
+// A service is given as protocol:service:port:instance, for example
+// tcp:http:80:Web server. The instance name may contain colons.
+static bool addService(MDNS & mdns, const char * text) {
+  std::string spec = text;
+  size_t first = spec.find(':');
+  size_t second = first == std::string::npos ? first : spec.find(':', first + 1);
+  size_t third = second == std::string::npos ? second : spec.find(':', second + 1);
+
+  if (third == std::string::npos) {
+    return false;
+  }
+
+  String protocol = spec.substr(0, first).c_str();
+  String service = spec.substr(first + 1, second - first - 1).c_str();
+  uint16_t port = atoi(spec.substr(second + 1, third - second - 1).c_str());
+  String instance = spec.substr(third + 1).c_str();
+
+  return mdns.addService(protocol, service, port, instance);
+}
+
+static void addTXTEntry(MDNS & mdns, const char * text) {
+  const char * equals = strchr(text, '=');
+
+  if (equals == NULL) {
+    mdns.addTXTEntry(text);
+  } else {
+    mdns.addTXTEntry(std::string(text, equals - text).c_str(), equals + 1);
+  }
+}
+
+static uint64_t percentile(std::vector<uint64_t> & sorted, int percent) {
+  return sorted.empty() ? 0 : sorted[(sorted.size() - 1) * percent / 100];
+}
+
+static void printHistogram(const char * name, const uint32_t * histogram) {
+  printf("  %-8s", name);
+
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    printf(" %8u", histogram[i]);
+  }
+
+  printf("\n");
+}
+
+static void usage(const char * name) {
+  fprintf(stderr,
+    "usage: %s [-n hostname] [-a address] [-s protocol:service:port:instance [-t key=value]...]...\n"
+    "       [-g golden | -w golden] [-v] capture\n", name);
+}
+
+int main(int argc, char ** argv) {
+  MDNS mdns;
+  const char * hostname = "replay";
+  const char * goldenPath = NULL;
+  const char * writePath = NULL;
+  bool verbose = false;
+  std::vector<std::pair<int, const char *> > services;
+  int option;
+
+  while ((option = getopt(argc, argv, "n:a:s:t:g:w:v")) != -1) {
+    if (option == 'n') {
+      hostname = optarg;
+    } else if (option == 'a') {
+      IPAddress ip;
+
+      if (!parseAddress(optarg, ip)) {
+        fprintf(stderr, "invalid address %s\n", optarg);
+        return 2;
+      }
+
+      WiFi.setLocalIP(ip);
+    } else if (option == 's' || option == 't') {
+      services.push_back(std::make_pair(option, optarg));
+    } else if (option == 'g') {
+      goldenPath = optarg;
+    } else if (option == 'w') {
+      writePath = optarg;
+    } else if (option == 'v') {
+      verbose = true;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  if (optind != argc - 1 || (goldenPath != NULL && writePath != NULL)) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  if (!mdns.setHostname(hostname)) {
+    fprintf(stderr, "%s: %s\n", hostname, mdns.getStatus().c_str());
+    return 2;
+  }
+
+  // Services and TXT entries are added in the order given, since -t applies
+  // to the service before it.
+  for (size_t i = 0; i < services.size(); i++) {
+    if (services[i].first == 't') {
+      addTXTEntry(mdns, services[i].second);
+    } else if (!addService(mdns, services[i].second)) {
+      fprintf(stderr, "%s: %s\n", services[i].second, mdns.getStatus().c_str());
+      return 2;
+    }
+  }
+
+  Capture capture;
+  std::vector<Frame> frames;
+
+  if (!capture.read(argv[optind], frames)) {
+    fprintf(stderr, "%s: not a readable pcap or pcapng file\n", argv[optind]);
+    return 2;
+  }
+
+  std::map<size_t, std::vector<std::string> > golden;
+
+  if (goldenPath != NULL && !readGolden(goldenPath, golden)) {
+    fprintf(stderr, "%s: cannot read golden output\n", goldenPath);
+    return 2;
+  }
+
+  FILE * output = writePath != NULL ? fopen(writePath, "w") : NULL;
+
+  if (writePath != NULL && output == NULL) {
+    fprintf(stderr, "%s: cannot write golden output\n", writePath);
+    return 2;
+  }
+
+  mdns.begin();
+
+  // Probing and announcing finish before the first packet is replayed.
+  for (int n = 0; n < 40; n++) {
+    mdns.processQueries();
+    HostClock::advance(PROBE_INTERVAL);
+  }
+
+  HostNetwork::clear();
+
+#if MDNS_STATS
+  mdns.resetStats();
+#endif
+
+  unsigned long base = millis();
+  std::vector<uint64_t> latencies;
+  size_t responses = 0;
+  size_t responseBytes = 0;
+  size_t maxResponse = 0;
+  size_t differences = 0;
+
+  for (size_t i = 0; i < frames.size(); i++) {
+    Frame & frame = frames[i];
+    unsigned long time = base + (frame.micros - frames[0].micros) / 1000;
+
+    if ((long) (time - millis()) > 0) {
+      HostClock::set(time);
+    }
+
+    HostNetwork::receive(frame.data, frame.size, frame.ip, frame.port);
+
+    Clock::time_point start = Clock::now();
+
+    mdns.processQueries();
+
+    uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+    // Delayed answers are flushed until the next packet arrives or the
+    // longest delay has passed, whichever comes first.
+    unsigned long deadline = time + SHARED_RESPONSE_MAX_DELAY;
+
+    if (i + 1 < frames.size()) {
+      deadline = std::min(deadline, base + (unsigned long) ((frames[i + 1].micros - frames[0].micros) / 1000));
+    }
+
+    while ((long) (deadline - millis()) > 0) {
+      HostClock::advance(1);
+
+      size_t sent = HostNetwork::sent().size();
+
+      start = Clock::now();
+
+      mdns.processQueries();
+
+      if (HostNetwork::sent().size() > sent) {
+        latency += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+      }
+    }
+
+    latencies.push_back(latency);
+
+    std::vector<std::string> lines;
+    size_t bytes = 0;
+
+    for (size_t n = 0; n < HostNetwork::sent().size(); n++) {
+      HostNetwork::Datagram & datagram = HostNetwork::sent()[n];
+
+      lines.push_back(describe(i, datagram));
+
+      bytes += datagram.data.size();
+      maxResponse = std::max(maxResponse, datagram.data.size());
+    }
+
+    responses += lines.size();
+    responseBytes += bytes;
+
+    HostNetwork::sent().clear();
+
+    if (verbose) {
+      printf("%6zu %10lu ms %3d.%d.%d.%d:%-5u %5zu B in %8llu ns %2zu out %5zu B\n", i, time - base,
+        frame.ip[0], frame.ip[1], frame.ip[2], frame.ip[3], frame.port, frame.size, (unsigned long long) latency, lines.size(), bytes);
+    }
+
+    for (size_t n = 0; output != NULL && n < lines.size(); n++) {
+      fprintf(output, "%s\n", lines[n].c_str());
+    }
+
+    if (goldenPath != NULL) {
+      std::map<size_t, std::vector<std::string> >::iterator expected = golden.find(i);
+      bool same = expected == golden.end() ? lines.empty() : expected->second == lines;
+
+      if (!same && differences < DIFF_REPORT_LIMIT) {
+        printf("packet %zu differs:\n", i);
+
+        for (size_t n = 0; expected != golden.end() && n < expected->second.size(); n++) {
+          printf("  - %s\n", expected->second[n].c_str());
+        }
+
+        for (size_t n = 0; n < lines.size(); n++) {
+          printf("  + %s\n", lines[n].c_str());
+        }
+      }
+
+      differences += same ? 0 : 1;
+    }
+  }
+
+  if (output != NULL) {
+    fclose(output);
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+
+  printf("packets      %zu replayed, %zu other frames skipped\n", frames.size(), capture.skipped);
+  printf("latency ns   min %llu  p50 %llu  p90 %llu  p99 %llu  max %llu\n",
+    (unsigned long long) percentile(latencies, 0), (unsigned long long) percentile(latencies, 50),
+    (unsigned long long) percentile(latencies, 90), (unsigned long long) percentile(latencies, 99),
+    (unsigned long long) percentile(latencies, 100));
+  printf("responses    %zu datagrams, %zu B, mean %.1f B, max %zu B\n", responses, responseBytes,
+    responses > 0 ? (double) responseBytes / responses : 0.0, maxResponse);
+
+  MDNS::RateLimits limits = mdns.rateLimits();
+
+  printf("rate limits  %u records suppressed, %u queries throttled\n", limits.suppressedRecords, limits.throttledQueries);
+
+#if MDNS_STATS
+  MDNS::Stats stats = mdns.stats();
+
+  printf("questions    %u, %u matched, %u unmatched; %u malformed packets\n", stats.questions, stats.matchedQuestions, stats.unmatchedQuestions, stats.malformedPackets);
+  printf("suppressed   %u known answers, %u duplicate answers; %u truncations\n", stats.knownAnswers, stats.duplicateAnswers, stats.truncations);
+  printf("histograms   microseconds, bucket n counts samples under 2^n\n");
+  printHistogram("match", stats.matchMicros);
+  printHistogram("build", stats.buildMicros);
+  printHistogram("send", stats.sendMicros);
+#endif
+
+  if (goldenPath != NULL) {
+    printf("golden       %zu of %zu packets differ\n", differences, frames.size());
+  }
+
+  return differences > 0 ? 1 : 0;
+}
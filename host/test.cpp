@@ -0,0 +1,1419 @@
+// Regression tests for the responder on the host build.
+//
+// Each test drives a fresh MDNS through its public API, feeding datagrams in
+// through HostNetwork and moving time with HostClock, and checks what it
+// sends back. `make test` builds and runs them under AddressSanitizer and
+// UBSan, and exits non-zero if any fails.
+
+#include "MDNS.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#define CHECK(condition) do { if (!(condition)) { printf("  %s:%d: %s\n", __FILE__, __LINE__, #condition); return false; } } while (0)
+
+// Heap allocations made while counting is set. The responder thread
+// allocates too, so both are atomic.
+static std::atomic<bool> counting { false };
+static std::atomic<size_t> allocations { 0 };
+
+void * operator new(size_t size) {
+  void * p = malloc(size > 0 ? size : 1);
+
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+
+  if (counting) {
+    allocations++;
+  }
+
+  return p;
+}
+
+void * operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void * p) noexcept {
+  free(p);
+}
+
+void operator delete(void * p, size_t size) noexcept {
+  free(p);
+}
+
+void operator delete[](void * p) noexcept {
+  free(p);
+}
+
+void operator delete[](void * p, size_t size) noexcept {
+  free(p);
+}
+
+class Query {
+public:
+  Query(uint16_t id = 0, uint16_t flags = 0) {
+    uint8_t header[12] = { (uint8_t) (id >> 8), (uint8_t) id, (uint8_t) (flags >> 8), (uint8_t) flags };
+    data.assign(header, header + sizeof(header));
+  }
+
+  Query & question(const char * name, uint16_t type, uint16_t cls = IN_CLASS) {
+    writeName(name);
+    writeUInt16(type);
+    writeUInt16(cls);
+    data[5]++;
+    return *this;
+  }
+
+  Query & address(const char * name, IPAddress address, uint32_t ttl = 120) {
+    writeName(name);
+    writeUInt16(A_TYPE);
+    writeUInt16(IN_CLASS | CACHE_FLUSH_FLAG);
+    writeUInt16(ttl >> 16);
+    writeUInt16(ttl);
+    writeUInt16(IP_SIZE);
+
+    for (int i = 0; i < IP_SIZE; i++) {
+      data.push_back(address[i]);
+    }
+
+    data[7]++;
+    return *this;
+  }
+
+  Query & pointer(const char * name, const char * instance, uint32_t ttl = 120) {
+    writeName(name);
+    writeUInt16(PTR_TYPE);
+    writeUInt16(IN_CLASS);
+    writeUInt16(ttl >> 16);
+    writeUInt16(ttl);
+    writeUInt16(strlen(instance) + 1 + nameSize(name));
+    writeLabel(instance);
+    writeName(name);
+
+    data[7]++;
+    return *this;
+  }
+
+  Query & service(const char * instance, const char * name, uint16_t port, const char * target, uint32_t ttl = 120) {
+    writeLabel(instance);
+    writeName(name);
+    writeUInt16(SRV_TYPE);
+    writeUInt16(IN_CLASS | CACHE_FLUSH_FLAG);
+    writeUInt16(ttl >> 16);
+    writeUInt16(ttl);
+    writeUInt16(6 + nameSize(target));
+    writeUInt16(0);
+    writeUInt16(0);
+    writeUInt16(port);
+    writeName(target);
+
+    data[7]++;
+    return *this;
+  }
+
+  // The records added so far go in the authority section, as in a probe.
+  Query & authority() {
+    data[9] = data[7];
+    data[7] = 0;
+    return *this;
+  }
+
+  void send(IPAddress ip = IPAddress(192, 168, 1, 20), uint16_t port = MDNS_PORT) {
+    HostNetwork::receive(data.data(), data.size(), ip, port);
+  }
+
+  std::vector<uint8_t> data;
+
+private:
+  void writeName(const char * name) {
+    while (*name) {
+      const char * dot = strchr(name, DOT);
+      size_t size = dot ? dot - name : strlen(name);
+
+      data.push_back(size);
+      data.insert(data.end(), name, name + size);
+
+      name += dot ? size + 1 : size;
+    }
+
+    data.push_back(END_OF_NAME);
+  }
+
+  // A single label, dots and all.
+  void writeLabel(const char * label) {
+    data.push_back(strlen(label));
+    data.insert(data.end(), label, label + strlen(label));
+  }
+
+  static size_t nameSize(const char * name) {
+    return strlen(name) + 2;
+  }
+
+  void writeUInt16(uint16_t value) {
+    data.push_back(value >> 8);
+    data.push_back(value);
+  }
+};
+
+static bool contains(const HostNetwork::Datagram & datagram, const char * text) {
+  std::string data(datagram.data.begin(), datagram.data.end());
+
+  return data.find(text) != std::string::npos;
+}
+
+static bool contains(const HostNetwork::Datagram & datagram, const uint8_t * bytes, size_t size) {
+  return std::search(datagram.data.begin(), datagram.data.end(), bytes, bytes + size) != datagram.data.end();
+}
+
+// A datagram taken apart section by section. parse() fails unless every name
+// and every record length adds up and nothing is left over, so a test can
+// check that what went out is well formed before looking inside.
+struct MessageQuestion {
+  std::string name;
+  uint16_t type;
+  uint16_t cls;
+};
+
+struct MessageRecord {
+  std::string name;
+  uint16_t type;
+  uint16_t cls;
+  uint32_t ttl;
+  std::vector<uint8_t> data;
+  std::string target;
+};
+
+struct Message {
+  uint16_t id;
+  uint16_t flags;
+  std::vector<MessageQuestion> questions;
+  std::vector<MessageRecord> records[3];
+};
+
+#define ANSWERS 0
+#define AUTHORITIES 1
+#define ADDITIONALS 2
+
+class MessageReader {
+public:
+  MessageReader(const std::vector<uint8_t> & data) : data(data) {
+  }
+
+  bool readUInt16(uint16_t & value) {
+    if (offset + 2 > data.size()) {
+      return false;
+    }
+
+    value = data[offset] << 8 | data[offset + 1];
+    offset += 2;
+    return true;
+  }
+
+  bool readUInt32(uint32_t & value) {
+    uint16_t high;
+    uint16_t low;
+
+    if (!readUInt16(high) || !readUInt16(low)) {
+      return false;
+    }
+
+    value = (uint32_t) high << 16 | low;
+    return true;
+  }
+
+  // Dots and backslashes inside a label come back escaped, as the querier
+  // keeps them.
+  bool readName(std::string & name) {
+    size_t at = offset;
+    int jumps = 0;
+
+    name.clear();
+
+    while (true) {
+      if (at >= data.size()) {
+        return false;
+      }
+
+      uint8_t length = data[at];
+
+      if ((length & LABEL_POINTER) == LABEL_POINTER) {
+        if (at + 1 >= data.size() || ++jumps > 16) {
+          return false;
+        }
+
+        size_t target = (length & ~LABEL_POINTER) << 8 | data[at + 1];
+
+        if (jumps == 1) {
+          offset = at + 2;
+        }
+
+        if (target >= at) {
+          return false;
+        }
+
+        at = target;
+        continue;
+      }
+
+      if (length > MAX_LABEL_SIZE || at + 1 + length > data.size()) {
+        return false;
+      }
+
+      if (length == 0) {
+        if (jumps == 0) {
+          offset = at + 1;
+        }
+
+        return true;
+      }
+
+      if (!name.empty()) {
+        name += DOT;
+      }
+
+      for (size_t i = at + 1; i <= at + length; i++) {
+        if (data[i] == DOT || data[i] == BACKSLASH) {
+          name += BACKSLASH;
+        }
+
+        name += (char) data[i];
+      }
+
+      at += 1 + length;
+    }
+  }
+
+  const std::vector<uint8_t> & data;
+  size_t offset = 0;
+};
+
+static bool parse(const HostNetwork::Datagram & datagram, Message & message) {
+  MessageReader reader(datagram.data);
+  uint16_t counts[4];
+  uint16_t unused;
+
+  if (!reader.readUInt16(message.id) || !reader.readUInt16(message.flags)) {
+    return false;
+  }
+
+  for (int i = 0; i < 4; i++) {
+    if (!reader.readUInt16(counts[i])) {
+      return false;
+    }
+  }
+
+  message.questions.clear();
+
+  for (uint16_t n = 0; n < counts[0]; n++) {
+    MessageQuestion question;
+
+    if (!reader.readName(question.name) || !reader.readUInt16(question.type) || !reader.readUInt16(question.cls)) {
+      return false;
+    }
+
+    message.questions.push_back(question);
+  }
+
+  for (int section = 0; section < 3; section++) {
+    message.records[section].clear();
+
+    for (uint16_t n = 0; n < counts[section + 1]; n++) {
+      MessageRecord record;
+      uint16_t length;
+
+      if (!reader.readName(record.name) || !reader.readUInt16(record.type) || !reader.readUInt16(record.cls) ||
+      !reader.readUInt32(record.ttl) || !reader.readUInt16(length) || reader.offset + length > datagram.data.size()) {
+        return false;
+      }
+
+      size_t end = reader.offset + length;
+
+      record.data.assign(datagram.data.begin() + reader.offset, datagram.data.begin() + end);
+
+      if (record.type == PTR_TYPE || record.type == SRV_TYPE) {
+        if (record.type == SRV_TYPE && (!reader.readUInt16(unused) || !reader.readUInt16(unused) || !reader.readUInt16(unused))) {
+          return false;
+        }
+
+        if (!reader.readName(record.target) || reader.offset != end) {
+          return false;
+        }
+      }
+
+      reader.offset = end;
+
+      message.records[section].push_back(record);
+    }
+  }
+
+  return reader.offset == datagram.data.size();
+}
+
+static uint16_t answerCount(const HostNetwork::Datagram & datagram) {
+  return datagram.data[6] << 8 | datagram.data[7];
+}
+
+static bool isResponse(const HostNetwork::Datagram & datagram) {
+  return (datagram.data[2] & 0x80) != 0;
+}
+
+static void run(MDNS & mdns, unsigned long ms) {
+  for (unsigned long n = 0; n < ms; n++) {
+    mdns.processQueries();
+    HostClock::advance(1);
+  }
+}
+
+// Time moves ten times faster than real time, so a responder thread polling
+// every few milliseconds sees all of it.
+static void wait(unsigned long ms) {
+  for (unsigned long n = 0; n < ms; n++) {
+    HostClock::advance(1);
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+}
+
+// Probing and announcing are over after a few seconds.
+static void start(MDNS & mdns) {
+  HostNetwork::clear();
+  HostClock::set(0);
+
+  mdns.begin();
+
+  run(mdns, 5000);
+
+  HostNetwork::clear();
+}
+
+// Our answer to an address query carries the host NSEC record. Hearing it
+// back, as a looped back multicast or repeated by a peer, must not look like
+// someone else claiming the name.
+static bool ownResponseIsNoConflict() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+  mdns.addService("tcp", "http", 80, "Dev");
+
+  start(mdns);
+
+  Query().question("dev.local", A_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().size() == 1);
+
+  HostNetwork::Datagram response = HostNetwork::sent()[0];
+
+  HostNetwork::clear();
+  HostNetwork::receive(response.data.data(), response.data.size(), IPAddress(192, 168, 1, 10), MDNS_PORT);
+
+  run(mdns, 2000);
+
+  CHECK(mdns.getStatus() == "Ok");
+  CHECK(HostNetwork::sent().empty());
+
+  Query().question("dev.local", A_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(isResponse(HostNetwork::sent()[0]) && answerCount(HostNetwork::sent()[0]) == 1);
+
+  return true;
+}
+
+// A service added at runtime is probed, but the host and the services already
+// verified keep being answered meanwhile. Only the new instance is held back.
+static bool answersWhileProbing() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+  mdns.addService("tcp", "http", 80, "First");
+
+  start(mdns);
+
+  mdns.addService("tcp", "http", 8080, "Second");
+
+  Query().question("dev.local", A_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  Query().question("_http._tcp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  std::vector<HostNetwork::Datagram> responses;
+
+  for (std::vector<HostNetwork::Datagram>::const_iterator i = HostNetwork::sent().begin(); i != HostNetwork::sent().end(); ++i) {
+    if (isResponse(*i)) {
+      responses.push_back(*i);
+    }
+  }
+
+  CHECK(responses.size() == 2);
+  CHECK(answerCount(responses[0]) == 1);
+  CHECK(answerCount(responses[1]) == 1);
+  CHECK(contains(responses[1], "First"));
+  CHECK(!contains(responses[1], "Second"));
+
+  run(mdns, 5000);
+
+  HostNetwork::clear();
+
+  Query().question("_http._tcp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(answerCount(HostNetwork::sent()[0]) == 2);
+
+  return true;
+}
+
+// While the responder thread runs, the application reads published
+// snapshots, and resolve answers from the addresses the thread has cached.
+static bool threadedAccessors() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+  mdns.begin();
+  mdns.startThread();
+
+  wait(5000);
+
+  CHECK(mdns.memoryUsage().labels > 0);
+#if MDNS_STATS
+  CHECK(mdns.stats().packetsReceived == 0);
+#endif
+  CHECK(mdns.rateLimits().throttledQueries == 0);
+  CHECK(mdns.setBufferSize(MAX_BUFFER_SIZE));
+  CHECK(!mdns.setBufferSize(MIN_BUFFER_SIZE - 1));
+  CHECK(!mdns.begin());
+
+  IPAddress address;
+
+  CHECK(!mdns.resolve("peer", address));
+
+  wait(500);
+
+  Query(0, 0x8400).address("peer.local", IPAddress(192, 168, 1, 30)).send();
+
+  bool resolved = false;
+
+  for (int n = 0; n < 100 && !resolved; n++) {
+    wait(10);
+
+    resolved = mdns.resolve("peer", address);
+  }
+
+  mdns.stopThread();
+
+  CHECK(resolved);
+  CHECK(address == IPAddress(192, 168, 1, 30));
+#if MDNS_STATS
+  CHECK(mdns.stats().packetsReceived == 1);
+#endif
+
+  return true;
+}
+
+// A cached answer nobody asks about any more passes its refresh points
+// without a query. The deadline must still move on past each of them, or a
+// sleeping application would wake continuously until the entry expires.
+static bool deadlineMovesOn() {
+  MDNS mdns;
+  IPAddress address;
+
+  mdns.setHostname("dev");
+
+  start(mdns);
+
+  mdns.resolve("peer", address);
+
+  Query(0, 0x8400).address("peer.local", IPAddress(192, 168, 1, 30), 10).send();
+
+  run(mdns, 10);
+
+  CHECK(mdns.resolve("peer", address));
+
+  int wakeups = 0;
+  unsigned long end = millis() + 12000;
+
+  while ((long) (millis() - end) < 0 && wakeups < 1000) {
+    unsigned long deadline = mdns.getNextDeadline();
+
+    if ((long) (deadline - millis()) > 0) {
+      HostClock::set(deadline);
+    }
+
+    mdns.processTimers();
+
+    CHECK((long) (mdns.getNextDeadline() - millis()) > 0);
+
+    wakeups++;
+  }
+
+  CHECK(wakeups < 20);
+  CHECK(!mdns.resolve("peer", address));
+
+  return true;
+}
+
+// Removing the last instance of a service takes the service and subtype names
+// with it, says goodbye to the enumeration PTR, and leaves the responder as it
+// was before the service came.
+static bool removesEmptyService() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+  mdns.addService("udp", "sensor", 5000, "Dev");
+
+  start(mdns);
+
+  uint16_t labels = mdns.memoryUsage().labels;
+
+  mdns.addService("tcp", "http", 80, "Dev", std::vector<String>(1, "printer"));
+
+  run(mdns, 5000);
+
+  HostNetwork::clear();
+
+  CHECK(mdns.removeService("tcp", "http", "Dev"));
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(contains(HostNetwork::sent()[0], "_services"));
+  CHECK(mdns.memoryUsage().labels == labels);
+
+  HostNetwork::clear();
+
+  Query().question("_http._tcp.local", PTR_TYPE).send();
+  Query().question("_printer._sub._http._tcp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().empty());
+
+  Query().question("_services._dns-sd._udp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(answerCount(HostNetwork::sent()[0]) == 1);
+  CHECK(!contains(HostNetwork::sent()[0], "_http"));
+
+  CHECK(mdns.addService("tcp", "http", 80, "Dev", std::vector<String>(1, "printer")));
+
+  run(mdns, 5000);
+
+  HostNetwork::clear();
+
+  Query().question("_printer._sub._http._tcp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(answerCount(HostNetwork::sent()[0]) == 1);
+
+  return true;
+}
+
+// A response with more names than a small fixed table could hold still
+// points every repeated name at its first copy.
+static bool compressesManyNames() {
+  MDNS mdns;
+  Query query;
+  char service[8];
+  char name[32];
+
+  mdns.setHostname("dev");
+  mdns.setBufferSize(MAX_BUFFER_SIZE);
+
+  for (int n = 0; n < 20; n++) {
+    snprintf(service, sizeof(service), "s%d", n);
+
+    mdns.addService("tcp", service, 80, "Dev");
+
+    snprintf(name, sizeof(name), "_s%d._tcp.local", n);
+
+    query.question(name, PTR_TYPE);
+  }
+
+  start(mdns);
+
+  query.send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(answerCount(HostNetwork::sent()[0]) == 20);
+  CHECK(contains(HostNetwork::sent()[0], "\x03" "Dev\xc0"));
+  CHECK(!contains(HostNetwork::sent()[0], "\x03" "Dev\x04_s"));
+
+  return true;
+}
+
+// A known answer in the query holding at least half the record's TTL stops
+// the responder repeating it. One closer to expiry does not.
+static bool knownAnswerSuppresses() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+  mdns.addService("tcp", "http", 80, "Dev");
+
+  start(mdns);
+
+  Query().question("_http._tcp.local", PTR_TYPE).pointer("_http._tcp.local", "Dev", TTL_75MIN / 2).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().empty());
+
+  run(mdns, MULTICAST_INTERVAL);
+
+  Query().question("_http._tcp.local", PTR_TYPE).pointer("_http._tcp.local", "Dev", TTL_75MIN / 2 - 1).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  Message message;
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(parse(HostNetwork::sent()[0], message));
+  CHECK(message.records[ANSWERS].size() == 1);
+  CHECK(message.records[ANSWERS][0].target == "Dev._http._tcp.local");
+
+  return true;
+}
+
+// Questions for shared records that arrive while a response is still being
+// delayed are answered together in that response.
+static bool aggregatesDelayedAnswers() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+  mdns.addService("tcp", "http", 80, "Dev");
+  mdns.addService("tcp", "printer", 515, "Dev");
+
+  start(mdns);
+
+  Query().question("_http._tcp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MIN_DELAY / 2);
+
+  Query().question("_printer._tcp.local", PTR_TYPE).send(IPAddress(192, 168, 1, 21));
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  Message message;
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(parse(HostNetwork::sent()[0], message));
+  CHECK(message.records[ANSWERS].size() == 2);
+
+  return true;
+}
+
+// Another responder giving our shared answer while ours is delayed makes
+// ours redundant.
+static bool duplicateAnswerSuppresses() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+  mdns.addService("tcp", "http", 80, "Dev");
+
+  start(mdns);
+
+  Query().question("_http._tcp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MIN_DELAY / 2);
+
+  Query(0, 0x8400).pointer("_http._tcp.local", "Dev", TTL_75MIN).send(IPAddress(192, 168, 1, 30));
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  for (std::vector<HostNetwork::Datagram>::const_iterator i = HostNetwork::sent().begin(); i != HostNetwork::sent().end(); ++i) {
+    Message message;
+
+    CHECK(parse(*i, message));
+
+    for (std::vector<MessageRecord>::const_iterator r = message.records[ANSWERS].begin(); r != message.records[ANSWERS].end(); ++r) {
+      CHECK(r->type != PTR_TYPE);
+    }
+  }
+
+  return true;
+}
+
+static void addInstances(MDNS & mdns, int count) {
+  for (int n = 0; n < count; n++) {
+    char instance[64];
+
+    snprintf(instance, sizeof(instance), "Instance %02d with a name long enough to fill packets", n);
+
+    mdns.addService("tcp", "http", 80, instance);
+  }
+}
+
+// A response too large for one buffer is split across several packets, each
+// of them complete and within BUFFER_SIZE.
+static bool splitsLargeResponse() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+  addInstances(mdns, 10);
+
+  start(mdns);
+
+  Query().question("_http._tcp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  std::vector<std::string> instances;
+
+  CHECK(HostNetwork::sent().size() > 1);
+
+  for (std::vector<HostNetwork::Datagram>::const_iterator i = HostNetwork::sent().begin(); i != HostNetwork::sent().end(); ++i) {
+    Message message;
+
+    CHECK(i->data.size() <= BUFFER_SIZE);
+    CHECK(parse(*i, message));
+    CHECK((message.flags & TC_FLAG) == 0);
+
+    for (std::vector<MessageRecord>::const_iterator r = message.records[ANSWERS].begin(); r != message.records[ANSWERS].end(); ++r) {
+      CHECK(r->type == PTR_TYPE);
+      instances.push_back(r->target);
+    }
+  }
+
+  std::sort(instances.begin(), instances.end());
+
+  CHECK(instances.size() == 10);
+  CHECK(std::unique(instances.begin(), instances.end()) == instances.end());
+
+  return true;
+}
+
+// A legacy reply has to fit in one packet, so it stops at the last record
+// that fits and sets TC.
+static bool truncatesLegacyResponse() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+  addInstances(mdns, 10);
+
+  start(mdns);
+
+  Query(0x1234).question("_http._tcp.local", PTR_TYPE).send(IPAddress(192, 168, 1, 20), 40000);
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  Message message;
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(HostNetwork::sent()[0].data.size() <= BUFFER_SIZE);
+  CHECK(parse(HostNetwork::sent()[0], message));
+  CHECK(message.flags & TC_FLAG);
+  CHECK(message.records[ANSWERS].size() > 0);
+  CHECK(message.records[ANSWERS].size() < 10);
+  CHECK(message.records[ADDITIONALS].empty());
+
+  return true;
+}
+
+// A legacy resolver asking from its own port gets a direct reply that echoes
+// its ID and question, with TTLs capped at LEGACY_TTL.
+static bool answersLegacyQuery() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+  mdns.addService("tcp", "http", 80, "Dev");
+
+  start(mdns);
+
+  Query(0x4321).question("_http._tcp.local", PTR_TYPE).send(IPAddress(192, 168, 1, 20), 40000);
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  Message message;
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(HostNetwork::sent()[0].ip == IPAddress(192, 168, 1, 20));
+  CHECK(HostNetwork::sent()[0].port == 40000);
+  CHECK(parse(HostNetwork::sent()[0], message));
+  CHECK(message.id == 0x4321);
+  CHECK(message.questions.size() == 1);
+  CHECK(message.questions[0].name == "_http._tcp.local");
+  CHECK(message.questions[0].type == PTR_TYPE);
+  CHECK(message.records[ANSWERS].size() == 1);
+
+  for (int section = 0; section < 3; section++) {
+    for (std::vector<MessageRecord>::const_iterator r = message.records[section].begin(); r != message.records[section].end(); ++r) {
+      CHECK(r->ttl <= LEGACY_TTL);
+    }
+  }
+
+  return true;
+}
+
+// Each local address answers a PTR query for its reverse name with the
+// hostname.
+static bool answersReverseAddress() {
+  static const uint8_t IPV6[IPV6_SIZE] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01 };
+  static const char HEX[] = "0123456789abcdef";
+
+  MDNS mdns;
+
+  WiFi.addLocalIPv6(IPV6);
+
+  mdns.setHostname("dev");
+
+  start(mdns);
+
+  WiFi.clearLocalIPv6();
+
+  std::string ipv6Name;
+
+  for (int i = IPV6_SIZE - 1; i >= 0; i--) {
+    ipv6Name = ipv6Name + HEX[IPV6[i] & 0x0f] + DOT + HEX[IPV6[i] >> 4] + DOT;
+  }
+
+  ipv6Name += "ip6.arpa";
+
+  Query().question("10.1.168.192.in-addr.arpa", PTR_TYPE).question(ipv6Name.c_str(), PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  Message message;
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(parse(HostNetwork::sent()[0], message));
+  CHECK(message.records[ANSWERS].size() == 2);
+  CHECK(message.records[ANSWERS][0].type == PTR_TYPE);
+  CHECK(message.records[ANSWERS][0].target == "dev.local");
+  CHECK(message.records[ANSWERS][1].type == PTR_TYPE);
+  CHECK(message.records[ANSWERS][1].target == "dev.local");
+
+  std::vector<std::string> names;
+
+  names.push_back(message.records[ANSWERS][0].name);
+  names.push_back(message.records[ANSWERS][1].name);
+
+  CHECK(std::find(names.begin(), names.end(), "10.1.168.192.in-addr.arpa") != names.end());
+  CHECK(std::find(names.begin(), names.end(), ipv6Name) != names.end());
+
+  return true;
+}
+
+// Service type enumeration lists every service type that has an instance.
+static bool enumeratesServices() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+  mdns.addService("tcp", "http", 80, "Dev");
+  mdns.addService("tcp", "printer", 515, "Dev");
+
+  start(mdns);
+
+  Query().question("_services._dns-sd._udp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  Message message;
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(parse(HostNetwork::sent()[0], message));
+
+  std::vector<std::string> services;
+
+  for (std::vector<MessageRecord>::const_iterator r = message.records[ANSWERS].begin(); r != message.records[ANSWERS].end(); ++r) {
+    CHECK(r->name == "_services._dns-sd._udp.local");
+    CHECK(r->type == PTR_TYPE);
+    services.push_back(r->target);
+  }
+
+  std::sort(services.begin(), services.end());
+
+  CHECK(services.size() == 2);
+  CHECK(services[0] == "_http._tcp.local");
+  CHECK(services[1] == "_printer._tcp.local");
+
+  return true;
+}
+
+// A record multicast less than a second ago is not multicast again for a
+// second query, but is still sent to defend the name against a probe. A
+// source sending too many queries has the excess dropped.
+static bool rateLimitsAnswers() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+
+  start(mdns);
+
+  Query().question("dev.local", A_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(answerCount(HostNetwork::sent()[0]) == 1);
+
+  HostNetwork::clear();
+
+  Query().question("dev.local", A_TYPE).send(IPAddress(192, 168, 1, 21));
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().empty());
+  CHECK(mdns.rateLimits().suppressedRecords > 0);
+
+  Query().question("dev.local", ANY_TYPE).address("dev.local", IPAddress(192, 168, 1, 40)).authority().send(IPAddress(192, 168, 1, 40));
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  Message message;
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(parse(HostNetwork::sent()[0], message));
+  CHECK(message.records[ANSWERS].size() == 1);
+  CHECK(message.records[ANSWERS][0].name == "dev.local");
+  CHECK(message.records[ANSWERS][0].type == A_TYPE);
+
+  CHECK(mdns.rateLimits().throttledQueries == 0);
+
+  for (int n = 0; n <= SOURCE_MAX_QUERIES; n++) {
+    Query().question("_ipp._tcp.local", PTR_TYPE).send(IPAddress(192, 168, 1, 50));
+
+    run(mdns, 1);
+  }
+
+  CHECK(mdns.rateLimits().throttledQueries == 1);
+
+  return true;
+}
+
+#if MDNS_STATS
+// The counters follow what happens to each query: matched and unmatched
+// questions, answers sent, and answers left out as known or duplicate.
+static bool countsStats() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+  mdns.addService("tcp", "http", 80, "Dev");
+
+  start(mdns);
+
+  MDNS::Stats before = mdns.stats();
+
+  Query().question("_http._tcp.local", PTR_TYPE).question("_ipp._tcp.local", PTR_TYPE).send();
+
+  run(mdns, MULTICAST_INTERVAL);
+
+  Query().question("_http._tcp.local", PTR_TYPE).pointer("_http._tcp.local", "Dev", TTL_75MIN).send();
+
+  run(mdns, MULTICAST_INTERVAL);
+
+  Query().question("_http._tcp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MIN_DELAY / 2);
+
+  Query(0, 0x8400).pointer("_http._tcp.local", "Dev", TTL_75MIN).send(IPAddress(192, 168, 1, 30));
+
+  run(mdns, MULTICAST_INTERVAL);
+
+  MDNS::Stats after = mdns.stats();
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(after.packetsReceived - before.packetsReceived == 4);
+  CHECK(after.malformedPackets == before.malformedPackets);
+  CHECK(after.questions - before.questions == 4);
+  CHECK(after.matchedQuestions - before.matchedQuestions == 3);
+  CHECK(after.unmatchedQuestions - before.unmatchedQuestions == 1);
+  CHECK(after.responsesSent - before.responsesSent == 1);
+  CHECK(after.bytesSent - before.bytesSent == HostNetwork::sent()[0].data.size());
+  CHECK(after.knownAnswers - before.knownAnswers == 1);
+  CHECK(after.duplicateAnswers - before.duplicateAnswers == 1);
+
+  return true;
+}
+#endif
+
+// Subtypes are checked like the service name, and one bad subtype rejects
+// the whole service.
+static bool checksSubtypes() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+
+  CHECK(!mdns.addService("tcp", "http", 80, "Dev", { "printer", "bad.subtype" }));
+  CHECK(mdns.getStatus() == "Invalid name");
+  CHECK(!mdns.addService("tcp", "http", 80, "Dev", { "" }));
+  CHECK(mdns.getStatus() == "Invalid name");
+  CHECK(!mdns.addService("tcp", "http", 80, "Dev", { std::string(MAX_LABEL_SIZE - 1, 'x').c_str() }));
+  CHECK(mdns.getStatus() == "Invalid name");
+  CHECK(mdns.addService("tcp", "http", 80, "Dev", { "printer" }));
+
+  start(mdns);
+
+  Query().question("_printer._sub._http._tcp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(answerCount(HostNetwork::sent()[0]) == 1);
+
+  return true;
+}
+
+// Blocks too large for the arena spill over to the heap, up to the largest
+// size a block can record.
+static bool arenaLimitsBlockSize() {
+  Arena arena(256);
+
+  CHECK(arena.allocate(ARENA_MAX_BLOCK_SIZE + 1) == NULL);
+  CHECK(arena.getHeapUsed() == 0);
+
+  void * p = arena.allocate(ARENA_MAX_BLOCK_SIZE);
+
+  CHECK(p != NULL);
+  CHECK(arena.getHeapUsed() > ARENA_MAX_BLOCK_SIZE);
+
+  arena.release(p);
+
+  CHECK(arena.getHeapUsed() == 0);
+
+  return true;
+}
+
+struct Found {
+  String instance;
+  String host;
+  uint16_t port;
+  bool available;
+};
+
+static std::vector<Found> found;
+
+static void onFound(String instance, String host, uint16_t port, bool available) {
+  Found entry = { instance, host, port, available };
+
+  found.push_back(entry);
+}
+
+// An instance name may contain dots. It stays one label when the querier
+// asks for its SRV record, and reaches the browse callback as it was sent.
+static bool browsesDottedInstance() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+
+  start(mdns);
+
+  found.clear();
+
+  CHECK(mdns.browse("ipp", "tcp", onFound));
+
+  run(mdns, 100);
+
+  Query(0, 0x8400).pointer("_ipp._tcp.local", "Living Rm. Printer").send();
+
+  run(mdns, 1000);
+
+  static const char SRV_QUESTION[] = "\x12Living Rm. Printer\x04_ipp\x04_tcp\x05local";
+
+  bool asked = false;
+
+  for (std::vector<HostNetwork::Datagram>::const_iterator i = HostNetwork::sent().begin(); i != HostNetwork::sent().end(); ++i) {
+    asked = asked || (!isResponse(*i) && contains(*i, SRV_QUESTION));
+  }
+
+  CHECK(asked);
+  CHECK(found.empty());
+
+  Query(0, 0x8400).service("Living Rm. Printer", "_ipp._tcp.local", 631, "printer.local").send();
+
+  run(mdns, 100);
+
+  CHECK(found.size() == 1);
+  CHECK(found[0].instance == "Living Rm. Printer");
+  CHECK(found[0].host == "printer.local");
+  CHECK(found[0].port == 631);
+  CHECK(found[0].available);
+
+  return true;
+}
+
+// Later browse queries list the instance as a known answer. Its name goes
+// out as one label, and the record length matches what follows.
+static bool knownAnswerKeepsDottedInstance() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+
+  start(mdns);
+
+  CHECK(mdns.browse("ipp", "tcp", onFound));
+
+  run(mdns, 100);
+
+  Query(0, 0x8400).pointer("_ipp._tcp.local", "Living Rm. Printer", 4500).service("Living Rm. Printer", "_ipp._tcp.local", 631, "printer.local").send();
+
+  run(mdns, 10);
+
+  HostNetwork::clear();
+
+  run(mdns, 10000);
+
+  int knownAnswers = 0;
+
+  for (std::vector<HostNetwork::Datagram>::const_iterator i = HostNetwork::sent().begin(); i != HostNetwork::sent().end(); ++i) {
+    Message message;
+
+    CHECK(parse(*i, message));
+
+    for (std::vector<MessageRecord>::const_iterator r = message.records[ANSWERS].begin(); !isResponse(*i) && r != message.records[ANSWERS].end(); ++r) {
+      CHECK(r->type == PTR_TYPE && r->name == "_ipp._tcp.local");
+      CHECK(r->target == "Living Rm\\. Printer._ipp._tcp.local");
+
+      knownAnswers++;
+    }
+  }
+
+  CHECK(knownAnswers > 0);
+
+  return true;
+}
+
+// An instance whose SRV record never comes is asked for a few times and then
+// left alone until its PTR record is received again.
+static bool unansweredServiceBacksOff() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+
+  start(mdns);
+
+  CHECK(mdns.browse("ipp", "tcp", onFound));
+
+  run(mdns, 100);
+
+  Query(0, 0x8400).pointer("_ipp._tcp.local", "Silent", 4500).send();
+
+  run(mdns, 60000);
+
+  int queries = 0;
+
+  for (std::vector<HostNetwork::Datagram>::const_iterator i = HostNetwork::sent().begin(); i != HostNetwork::sent().end(); ++i) {
+    Message message;
+
+    CHECK(parse(*i, message));
+
+    for (std::vector<MessageQuestion>::const_iterator q = message.questions.begin(); !isResponse(*i) && q != message.questions.end(); ++q) {
+      queries += q->type == SRV_TYPE ? 1 : 0;
+    }
+  }
+
+  CHECK(queries > 0);
+  CHECK(queries <= QUERY_ATTEMPTS);
+
+  return true;
+}
+
+// When the address changes, the old A record and its reverse name are
+// withdrawn with a goodbye before the new address is announced.
+static bool addressChangeSaysGoodbye() {
+  MDNS mdns;
+
+  mdns.setHostname("dev");
+
+  start(mdns);
+
+  WiFi.setLocalIP(IPAddress(192, 168, 1, 11));
+
+  run(mdns, 1000);
+
+  WiFi.setLocalIP(IPAddress(192, 168, 1, 10));
+
+  static const uint8_t OLD_GOODBYE[] = { 0x00, 0x01, 0x80, 0x01, 0, 0, 0, 0, 0x00, 0x04, 192, 168, 1, 10 };
+  static const uint8_t NEW_ADDRESS[] = { 0x00, 0x04, 192, 168, 1, 11 };
+
+  CHECK(HostNetwork::sent().size() > 1);
+  CHECK(answerCount(HostNetwork::sent()[0]) == 2);
+  CHECK(contains(HostNetwork::sent()[0], OLD_GOODBYE, sizeof(OLD_GOODBYE)));
+  CHECK(contains(HostNetwork::sent()[0], "in-addr"));
+  CHECK(!contains(HostNetwork::sent()[0], NEW_ADDRESS, sizeof(NEW_ADDRESS)));
+  CHECK(contains(HostNetwork::sent().back(), NEW_ADDRESS, sizeof(NEW_ADDRESS)));
+
+  return true;
+}
+
+static constexpr auto TCP = wireLabel("_tcp");
+static constexpr auto HTTP = wireLabel("_http");
+static constexpr auto PRINTER = wireLabel("_printer");
+static constexpr auto DEV = wireLabel("dev");
+static constexpr auto FIRST = wireLabel("First");
+static constexpr auto OTHER = wireLabel("Other");
+static constexpr auto TXT = wireTXT("path=/", "v=1");
+static constexpr auto EMPTY = wireTXT("");
+
+static const uint8_t * const SUBSERVICES[] = { PRINTER.data };
+
+static const MDNS::StaticService SERVICES[] = {
+  { TCP.data, HTTP.data, 80, FIRST.data, SUBSERVICES, 1, TXT.data, sizeof(TXT.data) },
+  { TCP.data, HTTP.data, 8080, OTHER.data, NULL, 0, EMPTY.data, sizeof(EMPTY.data) },
+};
+
+static const MDNS::StaticConfiguration CONFIGURATION = { DEV.data, SERVICES, 2 };
+
+// A configuration from flash is not zero-heap: names and TXT data stay where
+// they are, but the responder's own tables take 18 blocks for two instances
+// of one service, one with a subtype. That is 10 for the record index, 3 for
+// the label, probe and announcement lists, 4 for the PTR lists of the
+// service, subtype and enumeration names and 1 for the matcher.
+static bool staticConfiguration() {
+  MDNS mdns;
+
+  HostNetwork::clear();
+  HostClock::set(0);
+
+  allocations = 0;
+  counting = true;
+
+  bool started = mdns.begin(CONFIGURATION);
+
+  counting = false;
+
+  CHECK(started);
+  CHECK(allocations <= 18);
+
+  run(mdns, 5000);
+
+  HostNetwork::clear();
+
+  Query().question("_http._tcp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(answerCount(HostNetwork::sent()[0]) == 2);
+  CHECK(contains(HostNetwork::sent()[0], "path=/"));
+
+  HostNetwork::clear();
+
+  Query().question("_printer._sub._http._tcp.local", PTR_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(answerCount(HostNetwork::sent()[0]) == 1);
+  CHECK(contains(HostNetwork::sent()[0], "First"));
+
+  return true;
+}
+
+static constexpr auto BAD_HOST = wireLabel("dev.local");
+static constexpr auto NO_UNDERSCORE = wireLabel("http");
+
+static const uint8_t * const BAD_SUBTYPES[] = { NO_UNDERSCORE.data };
+
+static const MDNS::StaticService BAD_SERVICES[] = {
+  { TCP.data, NO_UNDERSCORE.data, 80, FIRST.data, NULL, 0, TXT.data, sizeof(TXT.data) },
+};
+
+static const MDNS::StaticService BAD_SUBSERVICES[] = {
+  { TCP.data, HTTP.data, 80, FIRST.data, SUBSERVICES, 1, TXT.data, sizeof(TXT.data) },
+  { TCP.data, HTTP.data, 81, OTHER.data, BAD_SUBTYPES, 1, TXT.data, sizeof(TXT.data) },
+};
+
+// Names from flash get the checks setHostname and addService apply, and a
+// conflict still renames them.
+static bool staticConfigurationChecks() {
+  MDNS badHost;
+  MDNS badService;
+  MDNS badSubService;
+
+  CHECK(!badHost.begin(MDNS::StaticConfiguration { BAD_HOST.data, SERVICES, 2 }));
+  CHECK(badHost.getStatus() == "Invalid hostname");
+  CHECK(!badService.begin(MDNS::StaticConfiguration { DEV.data, BAD_SERVICES, 1 }));
+  CHECK(badService.getStatus() == "Invalid name");
+  CHECK(!badSubService.begin(MDNS::StaticConfiguration { DEV.data, BAD_SUBSERVICES, 2 }));
+  CHECK(badSubService.getStatus() == "Invalid name");
+
+  MDNS mdns;
+
+  HostNetwork::clear();
+  HostClock::set(0);
+
+  CHECK(mdns.begin(CONFIGURATION));
+
+  run(mdns, 100);
+
+  Query(0, 0x8400).address("dev.local", IPAddress(192, 168, 1, 99)).send();
+
+  run(mdns, 5000);
+
+  CHECK(mdns.getStatus() == "Renamed after a name conflict");
+
+  HostNetwork::clear();
+
+  Query().question("dev-2.local", A_TYPE).send();
+
+  run(mdns, SHARED_RESPONSE_MAX_DELAY);
+
+  CHECK(HostNetwork::sent().size() == 1);
+  CHECK(answerCount(HostNetwork::sent()[0]) == 1);
+
+  return true;
+}
+
+struct Test {
+  const char * name;
+  bool (*run)();
+};
+
+static const Test TESTS[] = {
+  { "own response is no conflict", ownResponseIsNoConflict },
+  { "answers while probing", answersWhileProbing },
+  { "threaded accessors", threadedAccessors },
+  { "deadline moves on", deadlineMovesOn },
+  { "removes empty service", removesEmptyService },
+  { "compresses many names", compressesManyNames },
+  { "known answer suppresses", knownAnswerSuppresses },
+  { "aggregates delayed answers", aggregatesDelayedAnswers },
+  { "duplicate answer suppresses", duplicateAnswerSuppresses },
+  { "splits large response", splitsLargeResponse },
+  { "truncates legacy response", truncatesLegacyResponse },
+  { "answers legacy query", answersLegacyQuery },
+  { "answers reverse address", answersReverseAddress },
+  { "enumerates services", enumeratesServices },
+  { "rate limits answers", rateLimitsAnswers },
+#if MDNS_STATS
+  { "counts stats", countsStats },
+#endif
+  { "checks subtypes", checksSubtypes },
+  { "arena limits block size", arenaLimitsBlockSize },
+  { "browses dotted instance", browsesDottedInstance },
+  { "known answer keeps dotted instance", knownAnswerKeepsDottedInstance },
+  { "unanswered service backs off", unansweredServiceBacksOff },
+  { "address change says goodbye", addressChangeSaysGoodbye },
+  { "static configuration", staticConfiguration },
+  { "static configuration checks", staticConfigurationChecks },
+};
+
+int main(int argc, char ** argv) {
+  int failures = 0;
+
+  for (size_t i = 0; i < sizeof(TESTS) / sizeof(TESTS[0]); i++) {
+    bool passed = TESTS[i].run();
+
+    printf("%-48s %s\n", TESTS[i].name, passed ? "ok" : "FAILED");
+
+    failures += passed ? 0 : 1;
+  }
+
+  return failures > 0 ? 1 : 0;
+}